@@ -1,9 +1,73 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #define INITIAL_CAPACITY 16
+// Size of one arena block holding lines read from a stream
+#define ARENA_BLOCK_SIZE (4 * 1024 * 1024)
+// Number of line slices collected before a single writev() call
+#define WRITE_BATCH 1024
+// Smallest byte range worth handing to its own thread with -j
+#define MIN_THREAD_RANGE (1024 * 1024)
+// Line limit meaning the whole input is reversed
+#define ALL_LINES SIZE_MAX
+
+// Position of one line stored in the arena
+typedef struct {
+    size_t block;   // Arena block holding the line
+    size_t offset;  // Start of the line within the block
+    size_t length;  // Line length in bytes, including the newline
+} Line;
+
+// Lines read from a stream, stored back to back in a few large blocks
+typedef struct {
+    char **blocks;
+    size_t block_count;
+    size_t block_capacity;
+    size_t used;        // Bytes used in the last block
+    size_t size;        // Size of the last block
+} Arena;
+
+// One spilled piece of input in the temporary file used by --max-memory
+typedef struct {
+    off_t offset;   // Position of the chunk in the spill file
+    size_t length;  // Chunk length in bytes
+    int partial;    // 1 if the chunk only holds the start of a line that continues in the next chunk
+} Chunk;
+
+// Batches line slices into iovecs so many lines go out in one syscall
+typedef struct {
+    int fd;
+    int count;
+    int positional;  // 1 to write at offset with pwritev instead of the file position
+    off_t offset;    // Next output offset when positional
+    struct iovec iov[WRITE_BATCH];
+} Writer;
+
+// One kept line in the ring buffer used by -n on streams, the buffer is reused by getline
+typedef struct {
+    char *data;
+    size_t capacity;
+    size_t length;
+} Slot;
+
+// Byte range of a mapped file reversed by one thread with -j
+typedef struct {
+    pthread_t thread;
+    const char *data;   // Start of the range in the mapping
+    size_t length;      // Range length in bytes, ends right after a newline or at end of file
+    int fd;             // Output file
+    off_t offset;       // Where the reversed range starts in the output file
+} Range;
 
 void file_error(const char *filename) {
     fprintf(stderr, "error: cannot open file '%s'\n", filename);
@@ -36,103 +100,618 @@ int check_file_parity(const char *input, const char *output) {
     return 0;
 }
 
+// Writes all batched slices, retrying on partial writes
+void writer_flush(Writer *w) {
+    struct iovec *iov = w->iov;
+    int left = w->count;
 
-int main(int argc, char *argv[]) {
-    
-    FILE *infile = stdin;
-    FILE *outfile = stdout;
-    char *input_filename = NULL;
-    char *output_filename = NULL;
+    while (left > 0) {
+        ssize_t written = w->positional ? pwritev(w->fd, iov, left, w->offset) : writev(w->fd, iov, left);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_exit("error: write failed");
+        }
+        w->offset += written;
 
-    // Check command line arguments
-    if (argc > 3) {
-        fprintf(stderr, "usage: reverse <input> <output>\n");
-        exit(1);
+        // Skip the slices that were fully written and trim the partial one
+        while (left > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            left--;
+        }
+        if (left > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
     }
 
-    // Open input file
-    if (argc == 2 || argc == 3) {
-        input_filename = argv[1];
-        infile = fopen(input_filename, "r");
-        if (!infile) {
-            file_error(input_filename);
+    w->count = 0;
+}
+
+void writer_add(Writer *w, const char *data, size_t len) {
+    w->iov[w->count].iov_base = (void *) data;
+    w->iov[w->count].iov_len = len;
+    w->count++;
+
+    if (w->count == WRITE_BATCH) {
+        writer_flush(w);
+    }
+}
+
+// Queues the lines of a buffer in reverse order, scanning backwards for newlines with memrchr
+// Each line ends right after a newline, except possibly the last one which has no newline at all
+// Stops after max_lines lines, so only the end of the buffer is ever touched
+void write_reversed(Writer *w, const char *data, size_t size, size_t max_lines) {
+    size_t end = size;
+    for (size_t lines = 0; end > 0 && lines < max_lines; lines++) {
+        const char *newline = (end > 1) ? memrchr(data, '\n', end - 1) : NULL;
+        size_t start = newline ? (size_t) (newline - data) + 1 : 0;
+
+        writer_add(w, data + start, end - start);
+        end = start;
+    }
+}
+
+Writer *writer_create(FILE *outfile) {
+    Writer *w = malloc(sizeof(Writer));
+    if (!w) {
+        error_exit("malloc failed");
+    }
+    w->fd = fileno(outfile);
+    w->count = 0;
+    w->positional = 0;
+    w->offset = 0;
+    return w;
+}
+
+// Thread body for -j, writes one range reversed at its own place in the output file
+void *reverse_range(void *arg) {
+    Range *range = arg;
+    Writer *w = malloc(sizeof(Writer));
+    if (!w) {
+        error_exit("malloc failed");
+    }
+    w->fd = range->fd;
+    w->count = 0;
+    w->positional = 1;
+    w->offset = range->offset;
+
+    write_reversed(w, range->data, range->length, ALL_LINES);
+    writer_flush(w);
+
+    free(w);
+    return NULL;
+}
+
+// Reverses a mapped file with several threads writing straight into a regular output file
+// The file is split into byte ranges ending right after a newline, the reversed output of a range
+// that ends at byte b starts at byte size - b, so every thread can fill its part of the preallocated file with pwritev
+// Returns 1 on success, 0 if the output is not a regular file we can write at fixed offsets
+int reverse_parallel(const char *data, size_t size, FILE *outfile, int threads) {
+    int fd = fileno(outfile);
+    struct stat st;
+
+    // Appending ignores write offsets, and pipes and terminals have none
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (fcntl(fd, F_GETFL) & O_APPEND)) {
+        return 0;
+    }
+    off_t base = lseek(fd, 0, SEEK_CUR);
+    if (base == -1) {
+        return 0;
+    }
+
+    // Preallocate the output so the threads never extend the file under each other
+    if (st.st_size < base + (off_t) size) {
+        fallocate(fd, 0, base, size);
+        if (ftruncate(fd, base + size) != 0) {
+            return 0;
         }
     }
 
-    // Test if the input file and output file are the same file
-    if (argc == 3) {
-        output_filename = argv[2];
-        if (check_file_parity(input_filename, output_filename) != 0) {
-            fprintf(stderr, "error: input and output file must differ\n");
-            fclose(infile);
-            exit(1);
+    if ((size_t) threads > size / MIN_THREAD_RANGE) {
+        threads = size / MIN_THREAD_RANGE;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    Range *ranges = malloc(threads * sizeof(Range));
+    if (!ranges) {
+        error_exit("malloc failed");
+    }
+
+    size_t start = 0;
+    for (int t = 0; t < threads; t++) {
+        size_t end = size;
+        if (t < threads - 1) {
+            // Move the split point forward to just after the next newline
+            end = size / threads * (t + 1);
+            if (end <= start) {
+                end = start + 1;
+            }
+            const char *newline = memchr(data + end - 1, '\n', size - end + 1);
+            end = newline ? (size_t) (newline - data) + 1 : size;
         }
-        outfile = fopen(output_filename, "w");
-        if (!outfile) {
-            fclose(infile);
-            file_error(output_filename);
+
+        ranges[t].data = data + start;
+        ranges[t].length = end - start;
+        ranges[t].fd = fd;
+        ranges[t].offset = base + (size - end);
+        start = end;
+    }
+
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&ranges[t].thread, NULL, reverse_range, &ranges[t]) != 0) {
+            // Out of threads, do this range on the current one
+            ranges[t].thread = pthread_self();
+            reverse_range(&ranges[t]);
         }
     }
+    for (int t = 0; t < threads; t++) {
+        if (!pthread_equal(ranges[t].thread, pthread_self())) {
+            pthread_join(ranges[t].thread, NULL);
+        }
+    }
+
+    // Leave the file position after the output, as sequential writes would
+    lseek(fd, base + size, SEEK_SET);
+    free(ranges);
+    return 1;
+}
+
+// Parses a byte count with an optional K, M or G suffix, returns 0 on invalid input
+size_t parse_size(const char *text) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || text[0] == '-') {
+        return 0;
+    }
+
+    switch (*end) {
+        case 'G': case 'g': value <<= 10; /* fall through */
+        case 'M': case 'm': value <<= 10; /* fall through */
+        case 'K': case 'k': value <<= 10; end++; break;
+        case '\0': break;
+        default: return 0;
+    }
+    if (*end != '\0') {
+        return 0;
+    }
+    return (size_t) value;
+}
+
+// Reverses a regular file without copying any line
+// The file is mapped and every line is written straight from the mapping
+// With a line limit the backward scan stops early, so only the pages holding those last lines are read
+// Returns 1 if the input was handled, 0 if it is not a mappable regular file
+int reverse_mapped_file(FILE *infile, FILE *outfile, int threads, size_t max_lines) {
+    struct stat st;
 
-    // Dynamically allocate memory
+    if (fstat(fileno(infile), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return 0;
+    }
+
+    size_t size = st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(infile), 0);
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+
+    if (max_lines == ALL_LINES && threads > 1 && reverse_parallel(data, size, outfile, threads)) {
+        munmap(data, size);
+        return 1;
+    }
+
+    Writer *w = writer_create(outfile);
+    write_reversed(w, data, size, max_lines);
+    writer_flush(w);
+
+    free(w);
+    munmap(data, size);
+    return 1;
+}
+
+// Reverses a stream of any size while holding at most max_memory bytes of input
+// Input is read into a buffer of max_memory bytes which is cut after its last newline and spilled to a temporary file
+// The chunks are then read back from last to first and each one is written with its lines reversed
+// A line longer than the buffer is spilled as several partial chunks that are written back in their original order
+void reverse_spilled(FILE *infile, FILE *outfile, size_t max_memory) {
+    char *buffer = malloc(max_memory);
+    if (!buffer) {
+        error_exit("malloc failed");
+    }
+
+    Chunk *chunks = NULL;
+    size_t chunk_count = 0;
+    size_t chunk_capacity = 0;
+    FILE *spill = NULL;
+    off_t spill_size = 0;
+
+    size_t filled = 0;
+    int in_long_line = 0;  // The previous chunk was partial, so the buffer starts in the middle of a line
+    int eof = 0;
+
+    Writer *w = writer_create(outfile);
+
+    while (1) {
+        if (!eof) {
+            filled += fread(buffer + filled, 1, max_memory - filled, infile);
+            if (filled < max_memory) {
+                if (ferror(infile)) {
+                    error_exit("error: read failed");
+                }
+                eof = 1;
+            }
+        }
+
+        // Everything fits in the budget, no need to touch the disk
+        if (eof && chunk_count == 0) {
+            write_reversed(w, buffer, filled, ALL_LINES);
+            break;
+        }
+        if (filled == 0) {
+            break;
+        }
+
+        // Cut after the last newline, or after the first one when finishing a long line so that line gets its own chunk
+        size_t cut = filled;
+        int partial = 0;
+        if (!eof || in_long_line) {
+            char *newline = in_long_line ? memchr(buffer, '\n', filled) : memrchr(buffer, '\n', filled);
+            if (newline) {
+                cut = newline - buffer + 1;
+            } else if (!eof) {
+                partial = 1;
+            }
+        }
+
+        if (!spill) {
+            spill = tmpfile();
+            if (!spill) {
+                error_exit("error: cannot create temporary file");
+            }
+        }
+
+        for (size_t done = 0; done < cut; ) {
+            ssize_t written = pwrite(fileno(spill), buffer + done, cut - done, spill_size + done);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                error_exit("error: write failed");
+            }
+            done += written;
+        }
+
+        if (chunk_count >= chunk_capacity) {
+            chunk_capacity = chunk_capacity ? chunk_capacity * 2 : INITIAL_CAPACITY;
+            Chunk *temp = realloc(chunks, chunk_capacity * sizeof(Chunk));
+            if (temp == NULL) {
+                error_exit("malloc failed");
+            }
+            chunks = temp;
+        }
+        chunks[chunk_count].offset = spill_size;
+        chunks[chunk_count].length = cut;
+        chunks[chunk_count].partial = partial;
+        chunk_count++;
+
+        spill_size += cut;
+        in_long_line = partial;
+        memmove(buffer, buffer + cut, filled - cut);
+        filled -= cut;
+    }
+
+    // Stream the chunks back from last to first
+    size_t i = chunk_count;
+    while (i > 0) {
+        // A long line spans the partial chunks before it plus this one, write them in their original order
+        size_t first = i - 1;
+        while (first > 0 && chunks[first - 1].partial) {
+            first--;
+        }
+
+        for (size_t c = first; c < i; c++) {
+            for (size_t done = 0; done < chunks[c].length; ) {
+                ssize_t got = pread(fileno(spill), buffer + done, chunks[c].length - done, chunks[c].offset + done);
+                if (got <= 0) {
+                    if (got == -1 && errno == EINTR) {
+                        continue;
+                    }
+                    error_exit("error: read failed");
+                }
+                done += got;
+            }
+
+            if (first == i - 1) {
+                write_reversed(w, buffer, chunks[c].length, ALL_LINES);
+            } else {
+                writer_add(w, buffer, chunks[c].length);
+            }
+            // The buffer is reused for the next chunk, so everything pointing into it must go out now
+            writer_flush(w);
+        }
+        i = first;
+    }
+    writer_flush(w);
+
+    if (spill) {
+        fclose(spill);
+    }
+    free(chunks);
+    free(w);
+    free(buffer);
+}
+
+// Starts a new arena block of at least min_size bytes, the old blocks stay in place
+void arena_grow(Arena *arena, size_t min_size) {
+    if (arena->block_count >= arena->block_capacity) {
+        arena->block_capacity = arena->block_capacity ? arena->block_capacity * 2 : INITIAL_CAPACITY;
+        char **temp = realloc(arena->blocks, arena->block_capacity * sizeof(char *));
+        if (temp == NULL) {
+            error_exit("malloc failed");
+        }
+        arena->blocks = temp;
+    }
+
+    size_t size = (min_size > ARENA_BLOCK_SIZE) ? min_size : ARENA_BLOCK_SIZE;
+    char *block = malloc(size);
+    if (!block) {
+        error_exit("malloc failed");
+    }
+
+    arena->blocks[arena->block_count++] = block;
+    arena->used = 0;
+    arena->size = size;
+}
+
+// Appends a line record, growing the record array by doubling
+void add_line(Line **lines, size_t *count, size_t *capacity, size_t block, size_t offset, size_t length) {
+    if (*count >= *capacity) {
+        *capacity *= 2;
+        Line *temp = realloc(*lines, *capacity * sizeof(Line));
+        if (temp == NULL) {
+            error_exit("malloc failed");
+        }
+        *lines = temp;
+    }
+
+    (*lines)[*count].block = block;
+    (*lines)[*count].offset = offset;
+    (*lines)[*count].length = length;
+    (*count)++;
+}
+
+// Reverses a stream by keeping all of it in memory
+// Input is read straight into large arena blocks and only an offset/length record is kept per line
+// A line that does not fit at the end of a block is moved to the start of the next one
+void reverse_arena(FILE *infile, FILE *outfile) {
+    Arena arena = {0};
     size_t capacity = INITIAL_CAPACITY;
     size_t count = 0;
-    char **lines = malloc(capacity * sizeof(char *));
+    Line *lines = malloc(capacity * sizeof(Line));
     if (!lines) {
         error_exit("malloc failed");
     }
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t c_count;
+    arena_grow(&arena, ARENA_BLOCK_SIZE);
+    size_t line_start = 0;  // Start of the unfinished line in the last block
 
-    //Using getline(), which dynamically allocates memory because *line = NULL 
-    while ((c_count = getline(&line, &len, infile)) != -1) {
+    while (1) {
+        // Block is full, carry the unfinished line over to a new one twice its size
+        if (arena.used == arena.size) {
+            char *old = arena.blocks[arena.block_count - 1];
+            size_t pending = arena.used - line_start;
+            arena_grow(&arena, pending * 2);
+            memcpy(arena.blocks[arena.block_count - 1], old + line_start, pending);
+            arena.used = pending;
+            line_start = 0;
+        }
+
+        char *block = arena.blocks[arena.block_count - 1];
+        size_t got = fread(block + arena.used, 1, arena.size - arena.used, infile);
+        if (got == 0) {
+            if (ferror(infile)) {
+                error_exit("error: read failed");
+            }
+            break;
+        }
+
+        // Record every line completed by the new bytes
+        char *scan = block + arena.used;
+        char *end = scan + got;
+        char *newline;
+        while ((newline = memchr(scan, '\n', end - scan)) != NULL) {
+            size_t next = newline - block + 1;
+            add_line(&lines, &count, &capacity, arena.block_count - 1, line_start, next - line_start);
+            line_start = next;
+            scan = newline + 1;
+        }
+        arena.used += got;
+    }
 
-        lines[count] = line;
-        count++;
+    // Last line without a newline
+    if (line_start < arena.used) {
+        add_line(&lines, &count, &capacity, arena.block_count - 1, line_start, arena.used - line_start);
+    }
+
+    //Write
+    Writer *w = writer_create(outfile);
+    for (size_t i = count; i > 0; i--) {
+        writer_add(w, arena.blocks[lines[i - 1].block] + lines[i - 1].offset, lines[i - 1].length);
+    }
+    writer_flush(w);
+
+    // Free
+    for (size_t i = 0; i < arena.block_count; i++) {
+        free(arena.blocks[i]);
+    }
+    free(arena.blocks);
+    free(lines);
+    free(w);
+}
+
+// Writes the last max_lines lines of a stream in reverse order
+// Streams cannot be read backwards, so the lines go through a ring buffer that keeps only the newest max_lines of them
+void reverse_tail(FILE *infile, FILE *outfile, size_t max_lines) {
+    if (max_lines == 0) {
+        return;
+    }
+
+    // The ring grows by doubling up to max_lines, so a large limit on a short input costs nothing
+    size_t capacity = INITIAL_CAPACITY < max_lines ? INITIAL_CAPACITY : max_lines;
+    size_t count = 0;
+    size_t next = 0;  // Slot the next line goes into, the oldest line once the ring is full
+    Slot *ring = calloc(capacity, sizeof(Slot));
+    if (!ring) {
+        error_exit("malloc failed");
+    }
 
-        //Allocate new buffer
-        line = NULL;
-        len = 0;
-        
-        //Reallocate more memory if needed
-        if (count >= capacity) {
-            capacity *= 2;
-            char **temp = realloc(lines, capacity * sizeof(char *));
+    while (1) {
+        if (count == capacity && capacity < max_lines) {
+            size_t new_capacity = (capacity > max_lines / 2) ? max_lines : capacity * 2;
+            Slot *temp = realloc(ring, new_capacity * sizeof(Slot));
             if (temp == NULL) {
-                //Cleanup in case error before exiting
-                for (size_t i = 0; i < count; i++) {
-                    free(lines[i]);
-                }
-                free(lines);
                 error_exit("malloc failed");
             }
-            lines = temp;
+            memset(temp + capacity, 0, (new_capacity - capacity) * sizeof(Slot));
+            ring = temp;
+            next = capacity;
+            capacity = new_capacity;
         }
+
+        // Overwriting the oldest line reuses its buffer
+        ssize_t got = getline(&ring[next].data, &ring[next].capacity, infile);
+        if (got == -1) {
+            break;
+        }
+        ring[next].length = got;
+        next = (next + 1) % capacity;
+        if (count < capacity) {
+            count++;
+        }
+    }
+
+    //Write, newest line first
+    Writer *w = writer_create(outfile);
+    for (size_t i = 0; i < count; i++) {
+        Slot *slot = &ring[(next + capacity - 1 - i) % capacity];
+        writer_add(w, slot->data, slot->length);
     }
+    writer_flush(w);
 
-    free(line);
+    for (size_t i = 0; i < capacity; i++) {
+        free(ring[i].data);
+    }
+    free(ring);
+    free(w);
+}
 
-    //Write
-    for (ssize_t i = count - 1; i >= 0; i--) {
-        if (fputs(lines[i], outfile) == EOF) {
-            fprintf(stderr, "error: write failed\n");
-            for (size_t j = 0; j < count; j++) {
-                free(lines[j]);
+// Matches an option letter alone, with the number in the next argument, or with the digits attached (-j4)
+// A file name that only starts with the letter, like -jobs.txt or -notes, is not the option
+int is_number_option(const char *arg, char letter) {
+    if (arg[0] != '-' || arg[1] != letter) {
+        return 0;
+    }
+    for (const char *c = arg + 2; *c != '\0'; c++) {
+        if (*c < '0' || *c > '9') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: reverse [-n N] [-j N] [--max-memory SIZE] <input> <output>\n");
+    exit(1);
+}
+
+
+int main(int argc, char *argv[]) {
+    
+    FILE *infile = stdin;
+    FILE *outfile = stdout;
+    char *input_filename = NULL;
+    char *output_filename = NULL;
+    size_t max_memory = 0;  // 0 means no budget, everything is kept in memory
+    int threads = 1;        // Threads used to reverse a regular file into a regular file
+    size_t max_lines = ALL_LINES;
+    char *files[2];
+    int file_count = 0;
+
+    // Check command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--max-memory") == 0) {
+            if (i + 1 >= argc || (max_memory = parse_size(argv[++i])) == 0) {
+                usage();
             }
-            //Cleanup in case error before exiting
-            free(lines);
-            if (infile != stdin) fclose(infile);
-            if (outfile != stdout) fclose(outfile);
-            exit(1);
+        } else if (strncmp(argv[i], "--max-memory=", 13) == 0) {
+            if ((max_memory = parse_size(argv[i] + 13)) == 0) {
+                usage();
+            }
+        } else if (is_number_option(argv[i], 'j')) {
+            const char *value = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "");
+            char *end = NULL;
+            long n = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || n < 1 || n > 1024) {
+                usage();
+            }
+            threads = n;
+        } else if (is_number_option(argv[i], 'n')) {
+            const char *value = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "");
+            char *end = NULL;
+            errno = 0;
+            unsigned long long n = strtoull(value, &end, 10);
+            if (end == value || *end != '\0' || value[0] == '-' || errno != 0) {
+                usage();
+            }
+            max_lines = n;
+        } else if (file_count < 2) {
+            files[file_count++] = argv[i];
+        } else {
+            usage();
         }
-        free(lines[i]);
     }
 
+    // Open input file
+    if (file_count >= 1) {
+        input_filename = files[0];
+        infile = fopen(input_filename, "r");
+        if (!infile) {
+            file_error(input_filename);
+        }
+    }
 
-    // Free
-    free(lines);
+    // Test if the input file and output file are the same file
+    if (file_count == 2) {
+        output_filename = files[1];
+        if (check_file_parity(input_filename, output_filename) != 0) {
+            fprintf(stderr, "error: input and output file must differ\n");
+            fclose(infile);
+            exit(1);
+        }
+        outfile = fopen(output_filename, "w");
+        if (!outfile) {
+            fclose(infile);
+            file_error(output_filename);
+        }
+    }
+
+    if (reverse_mapped_file(infile, outfile, threads, max_lines)) {
+        // Regular files are reversed straight from a memory mapping
+    } else if (max_lines != ALL_LINES) {
+        // Only the last lines of a stream are kept
+        reverse_tail(infile, outfile, max_lines);
+    } else if (max_memory > 0) {
+        // With a memory budget, streams are spilled to disk instead of being held in memory
+        reverse_spilled(infile, outfile, max_memory);
+    } else {
+        // Everything else is collected into the arena and written once input ends
+        reverse_arena(infile, outfile);
+    }
 
     // Close files
     if (infile != stdin)
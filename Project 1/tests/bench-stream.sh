@@ -0,0 +1,61 @@
+#!/bin/bash
+# Benchmark of the stream path of reverse: input arrives through a FIFO, so it cannot be memory mapped
+# and every line is kept in memory until the end of input
+# Reports wall time and, when GNU time is installed, the peak resident memory
+#
+# Usage, from Project 1:
+#   tests/bench-stream.sh                # current reverse.c only
+#   tests/bench-stream.sh before-arena   # also reverse.c as of the commit before the line arena
+#   tests/bench-stream.sh <revision>     # also reverse.c as of any git revision
+set -e
+
+cd "$(dirname "$0")/.."
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc -O2 -o "$work/reverse-current" reverse.c -lpthread
+builds="current"
+if [ -n "$1" ]; then
+    revision=$1
+    if [ "$revision" = before-arena ]; then
+        # Found by its subject, so the name survives a rebase
+        arena=$(git log -1 --format=%H --fixed-strings --grep="reverse: store streamed lines in an arena" -- reverse.c)
+        if [ -z "$arena" ]; then
+            echo "bench-stream: the arena commit is not in this history" >&2
+            exit 1
+        fi
+        revision=$arena^
+    fi
+    git show "$revision:Project 1/reverse.c" > "$work/baseline.c"
+    gcc -O2 -o "$work/reverse-baseline" "$work/baseline.c" -lpthread
+    builds="baseline current"
+fi
+
+# Short lines are the worst case for per-line allocation, long lines show the copy cost
+seq 1 3000000 > "$work/short.txt"
+awk 'BEGIN { srand(1); for (i = 0; i < 2000000; i++) { n = int(rand() * 160); s = ""; while (length(s) < n) s = s "abcdefghij"; print substr(s, 1, n) } }' > "$work/mixed.txt"
+
+run() {
+    local binary=$1 input=$2
+    mkfifo "$work/fifo"
+    cat "$input" > "$work/fifo" &
+    if [ -x /usr/bin/time ]; then
+        /usr/bin/time -f "%e s  %M KB" "$binary" < "$work/fifo" > "$work/out.txt" 2> "$work/time.txt" || true
+        tail -n 1 "$work/time.txt"
+    else
+        local TIMEFORMAT="%R s  (install GNU time for memory)"
+        time "$binary" < "$work/fifo" > "$work/out.txt"
+    fi
+    wait
+    rm -f "$work/fifo"
+    # The output has to be the input reversed
+    tac "$input" | cmp -s - "$work/out.txt" || echo "  output differs from tac"
+}
+
+for input in short mixed; do
+    echo "$input.txt: $(wc -l < "$work/$input.txt") lines, $(wc -c < "$work/$input.txt") bytes"
+    for build in $builds; do
+        printf '  %-8s  ' "$build"
+        run "$work/reverse-$build" "$work/$input.txt"
+    done
+done
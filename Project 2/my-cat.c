@@ -1,32 +1,768 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Buffer size for the read/write loop used when the kernel cannot copy for us
+#define COPY_BUFFER_SIZE (1024 * 1024)
+// Largest amount requested from a single copy_file_range, sendfile or splice call
+#define COPY_CHUNK (1 << 30)
+// Number of upcoming files that are opened and read ahead while earlier ones are written
+#define PREFETCH_WINDOW 32
+// Bytes read ahead from the start of every upcoming file, small files are read completely
+#define PREFETCH_SIZE (128 * 1024)
+// Threads opening and reading files when io_uring is not available
+#define PREFETCH_THREADS 8
+// Input and output buffer size for the line-processing options
+#define FORMAT_BUFFER_SIZE (1024 * 1024)
+
+// Ways of moving data from a file to stdout, from cheapest to most expensive
+typedef enum {
+    ENGINE_COPY_FILE_RANGE,     // File to file inside the kernel, may share extents on filesystems like btrfs or xfs
+    ENGINE_SPLICE,              // File to pipe (or pipe to anything) by moving page references
+    ENGINE_SENDFILE,            // File to any descriptor from the page cache
+    ENGINE_READ_WRITE           // Plain read/write through a user space buffer
+} Engine;
+
+// An upcoming file, opened and read ahead out of order, written strictly in order
+typedef struct {
+    size_t index;       // Position of the file in the argument list
+    int ready;          // Open and read have finished, the main thread may write the file
+    int fd;             // Open descriptor, or -1 if the file could not be opened
+    ssize_t length;     // Bytes read ahead into buffer, or -1 on a read error
+    char *buffer;       // PREFETCH_SIZE bytes
+} Slot;
+
+// Read-ahead state shared by the main thread and the prefetch workers
+typedef struct {
+    char **files;
+    size_t file_count;
+    Slot slots[PREFETCH_WINDOW];
+    size_t next;        // Next file to claim for read-ahead
+    size_t written;     // Files already written, claims stay within PREFETCH_WINDOW of this
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Prefetch;
+
+// Line-processing options and the state they carry from one block, and one file, to the next
+typedef struct {
+    int number;         // -n, number all output lines
+    int squeeze;        // -s, never print more than one empty line in a row
+    int show_all;       // -A, show nonprinting characters with ^ and M- notation, tabs as ^I and line ends as $
+    long long line;     // Number of the last numbered line
+    int line_start;     // The next byte starts a new line
+    int empty_lines;    // Empty lines seen in a row
+    char *out;          // Output buffer, flushed with large writes
+    size_t used;
+} Format;
+
+// Minimal io_uring submission and completion rings, set up with raw syscalls
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned pending;   // Prepared entries not yet handed to the kernel
+} Ring;
+
+// Kind of file behind a descriptor, decides which engines can work with it
+typedef enum {
+    KIND_REGULAR,
+    KIND_PIPE,
+    KIND_OTHER
+} Kind;
+
+// If size is not NULL it receives the size of a regular file
+Kind file_kind(int fd, off_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return KIND_OTHER;
+    }
+    if (size) {
+        *size = st.st_size;
+    }
+    // Files like those in /proc report size 0 and do not work with the in-kernel copies
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        return KIND_REGULAR;
+    }
+    if (S_ISFIFO(st.st_mode)) {
+        return KIND_PIPE;
+    }
+    return KIND_OTHER;
+}
+
+// Returns true for errors meaning "this engine cannot handle these descriptors", so the next one should be tried
+int engine_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == ESPIPE || err == EBADF;
+}
+
+// Picks the first engine worth trying for a given input and output
+Engine first_engine(Kind in, Kind out) {
+    if (in == KIND_REGULAR && out == KIND_REGULAR) {
+        return ENGINE_COPY_FILE_RANGE;
+    }
+    if (in == KIND_PIPE || out == KIND_PIPE) {
+        return ENGINE_SPLICE;
+    }
+    if (in == KIND_REGULAR) {
+        return ENGINE_SENDFILE;
+    }
+    return ENGINE_READ_WRITE;
+}
+
+// Writes the whole buffer, returns 0 on success and -1 on error
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Copies the rest of in_fd to out_fd
+// offset is the read position in a regular input and is advanced, or NULL to use the file position of other inputs
+// Returns 0 on success, -1 on a read or write error
+int copy_fd(int in_fd, off_t *offset, int out_fd, Kind in, Kind out) {
+    static char *buffer = NULL;
+    Engine engine = first_engine(in, out);
+
+    while (1) {
+        ssize_t n;
+
+        switch (engine) {
+            case ENGINE_COPY_FILE_RANGE:
+                n = copy_file_range(in_fd, offset, out_fd, NULL, COPY_CHUNK, 0);
+                break;
+            case ENGINE_SPLICE:
+                n = splice(in_fd, offset, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+                break;
+            case ENGINE_SENDFILE:
+                n = sendfile(out_fd, in_fd, offset, COPY_CHUNK);
+                break;
+            default:
+                if (buffer == NULL) {
+                    buffer = malloc(COPY_BUFFER_SIZE);
+                    if (buffer == NULL) {
+                        return -1;
+                    }
+                }
+                n = offset ? pread(in_fd, buffer, COPY_BUFFER_SIZE, *offset) : read(in_fd, buffer, COPY_BUFFER_SIZE);
+                if (n > 0) {
+                    if (write_all(out_fd, buffer, n) != 0) {
+                        return -1;
+                    }
+                    if (offset) {
+                        *offset += n;
+                    }
+                }
+                break;
+        }
+
+        if (n > 0) {
+            continue;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+
+        // Step down to the next engine that can work with these descriptors, the offset keeps our place
+        if (engine != ENGINE_READ_WRITE && engine_unsupported(errno)) {
+            if (engine == ENGINE_COPY_FILE_RANGE || engine == ENGINE_SPLICE) {
+                engine = (in == KIND_REGULAR) ? ENGINE_SENDFILE : ENGINE_READ_WRITE;
+            } else {
+                engine = ENGINE_READ_WRITE;
+            }
+            continue;
+        }
+        return -1;
+    }
+}
+
+// Writes one open file to stdout, starting with the length bytes already read ahead into head
+// Returns 0 on success, -1 on a read or write error
+int cat_fd(int fd, const char *head, ssize_t length, Kind out) {
+    off_t size = 0;
+    Kind in = file_kind(fd, &size);
+
+    if (length < 0 || (length > 0 && write_all(STDOUT_FILENO, head, length) != 0)) {
+        return -1;
+    }
+
+    // A regular file read completely during read-ahead needs nothing more
+    off_t offset = length;
+    if (in == KIND_REGULAR && offset >= size) {
+        return 0;
+    }
+    if (in == KIND_REGULAR) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    // Copy the rest to stdout, inside the kernel whenever possible
+    return copy_fd(fd, (in == KIND_REGULAR) ? &offset : NULL, STDOUT_FILENO, in, out);
+}
+
+// Writes the file in a finished slot and reports errors the same way the sequential loop does
+// Returns 0 to continue with the next file, 1 to stop with an error
+int cat_slot(Slot *slot, Kind out) {
+    if (slot->fd == -1) {
+        printf("my-cat: cannot open file\n");
+        return 1;
+    }
+
+    int result = cat_fd(slot->fd, slot->buffer, slot->length, out);
+    close(slot->fd);
+    if (result != 0) {
+        fprintf(stderr, "my-cat: read or write failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+int ring_setup(Ring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    // Make sure the kernel can open and read through the ring, both arrived in 5.6
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (probe == NULL || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) != 0 ||
+        probe->last_op < IORING_OP_READ ||
+        !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)) {
+        free(probe);
+        close(ring->fd);
+        return -1;
+    }
+    free(probe);
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+void ring_free(Ring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Returns a cleared submission entry, the window guarantees the queue never overflows
+struct io_uring_sqe *ring_get_sqe(Ring *ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned *) ring->sq_tail, tail + 1, memory_order_release);
+    ring->pending++;
+    return sqe;
+}
+
+// Hands prepared entries to the kernel and optionally waits for at least one completion
+int ring_enter(Ring *ring, unsigned wait) {
+    while (1) {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted >= 0) {
+            ring->pending -= submitted;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Operation kinds encoded in the low bit of the user data, the file index is in the rest
+#define OP_OPEN 0
+#define OP_READ 1
+
+void ring_submit_open(Ring *ring, Prefetch *prefetch, size_t index) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) prefetch->files[index];
+    sqe->open_flags = O_RDONLY;
+    sqe->user_data = (index << 1) | OP_OPEN;
+}
+
+void ring_submit_read(Ring *ring, Slot *slot) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->fd;
+    sqe->addr = (unsigned long) slot->buffer;
+    sqe->len = PREFETCH_SIZE;
+    sqe->off = (__u64) -1;  // Current file position, so pipes and terminals work too
+    sqe->user_data = (slot->index << 1) | OP_READ;
+}
+
+// Writes all files with io_uring keeping opens and reads in flight across the next PREFETCH_WINDOW files
+// Returns the exit status, or -1 if the ring could not be set up and nothing was written
+// A failure once files are in flight is reported here and ends the run with status 1
+int cat_io_uring(Prefetch *prefetch, Kind out) {
+    Ring ring;
+    if (ring_setup(&ring, 2 * PREFETCH_WINDOW) != 0) {
+        return -1;
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < prefetch->file_count && status == 0; i++) {
+        // Keep the window full of opens
+        while (prefetch->next < prefetch->file_count && prefetch->next < i + PREFETCH_WINDOW) {
+            Slot *slot = &prefetch->slots[prefetch->next % PREFETCH_WINDOW];
+            slot->index = prefetch->next;
+            slot->ready = 0;
+            ring_submit_open(&ring, prefetch, prefetch->next);
+            prefetch->next++;
+        }
+
+        Slot *current = &prefetch->slots[i % PREFETCH_WINDOW];
+        while (!current->ready) {
+            if (ring_enter(&ring, 1) != 0) {
+                // Files were already written, so falling back to threads would repeat them
+                fprintf(stderr, "my-cat: io_uring_enter failed: %s\n", strerror(errno));
+                status = -1;
+                break;
+            }
+
+            // Reap completions, a finished open starts the read of the same file
+            unsigned head = *ring.cq_head;
+            unsigned tail = atomic_load_explicit((_Atomic unsigned *) ring.cq_tail, memory_order_acquire);
+            for (; head != tail; head++) {
+                struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+                size_t index = cqe->user_data >> 1;
+                Slot *slot = &prefetch->slots[index % PREFETCH_WINDOW];
+
+                if ((cqe->user_data & 1) == OP_OPEN) {
+                    slot->fd = cqe->res;
+                    if (cqe->res < 0) {
+                        slot->fd = -1;
+                        slot->ready = 1;
+                    } else {
+                        ring_submit_read(&ring, slot);
+                    }
+                } else {
+                    slot->length = (cqe->res < 0) ? -1 : cqe->res;
+                    slot->ready = 1;
+                }
+            }
+            atomic_store_explicit((_Atomic unsigned *) ring.cq_head, head, memory_order_release);
+        }
+
+        if (status == 0) {
+            status = cat_slot(current, out);
+        }
+    }
+
+    ring_free(&ring);
+    return (status < 0) ? 1 : status;
+}
+
+// Prefetch worker, claims upcoming files in order and opens and reads them ahead
+void *prefetch_worker(void *arg) {
+    Prefetch *prefetch = arg;
+
+    pthread_mutex_lock(&prefetch->lock);
+    while (1) {
+        while (prefetch->next < prefetch->file_count && prefetch->next >= prefetch->written + PREFETCH_WINDOW) {
+            pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+        }
+        if (prefetch->next >= prefetch->file_count) {
+            break;
+        }
+        size_t index = prefetch->next++;
+        Slot *slot = &prefetch->slots[index % PREFETCH_WINDOW];
+        pthread_mutex_unlock(&prefetch->lock);
+
+        slot->length = 0;
+        slot->fd = open(prefetch->files[index], O_RDONLY);
+        if (slot->fd != -1) {
+            do {
+                slot->length = read(slot->fd, slot->buffer, PREFETCH_SIZE);
+            } while (slot->length == -1 && errno == EINTR);
+        }
+
+        // The main thread reads index under the lock while it waits, so it is only set here
+        pthread_mutex_lock(&prefetch->lock);
+        slot->index = index;
+        slot->ready = 1;
+        pthread_cond_broadcast(&prefetch->changed);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+    return NULL;
+}
+
+// Writes all files while a pool of threads opens and reads the upcoming ones
+// Used when io_uring is not available
+int cat_threads(Prefetch *prefetch, Kind out) {
+    pthread_t threads[PREFETCH_THREADS];
+    int thread_count = 0;
+
+    for (int t = 0; t < PREFETCH_THREADS; t++) {
+        if (pthread_create(&threads[thread_count], NULL, prefetch_worker, prefetch) == 0) {
+            thread_count++;
+        }
+    }
+    if (thread_count == 0) {
+        return -1;
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < prefetch->file_count && status == 0; i++) {
+        Slot *slot = &prefetch->slots[i % PREFETCH_WINDOW];
+
+        pthread_mutex_lock(&prefetch->lock);
+        while (!slot->ready || slot->index != i) {
+            pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+        }
+        pthread_mutex_unlock(&prefetch->lock);
+
+        status = cat_slot(slot, out);
+
+        // Free the slot for the file PREFETCH_WINDOW places ahead
+        pthread_mutex_lock(&prefetch->lock);
+        slot->ready = 0;
+        prefetch->written = i + 1;
+        pthread_cond_broadcast(&prefetch->changed);
+        pthread_mutex_unlock(&prefetch->lock);
+    }
+
+    // On an error the workers are still running, exiting the process stops them
+    if (status != 0) {
+        return status;
+    }
+    for (int t = 0; t < thread_count; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    return 0;
+}
+
+// Writes several files in argument order while the next ones are already being opened and read
+// Hides open and read latency when many (small) files come from a cold cache
+int cat_prefetched(char **files, size_t file_count, Kind out) {
+    Prefetch prefetch;
+    memset(&prefetch, 0, sizeof(prefetch));
+    prefetch.files = files;
+    prefetch.file_count = file_count;
+    pthread_mutex_init(&prefetch.lock, NULL);
+    pthread_cond_init(&prefetch.changed, NULL);
+
+    char *buffers = malloc((size_t) PREFETCH_WINDOW * PREFETCH_SIZE);
+    if (buffers == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < PREFETCH_WINDOW; i++) {
+        prefetch.slots[i].buffer = buffers + (size_t) i * PREFETCH_SIZE;
+    }
+
+    int status = cat_io_uring(&prefetch, out);
+    if (status == -1) {
+        status = cat_threads(&prefetch, out);
+    }
+
+    free(buffers);
+    return status;
+}
+
+// Returns the first byte at or after p that needs formatting, or end if there is none
+// That is a newline, and with -A also every control character, DEL and every byte with the high bit set
+// Newlines alone are found with memchr, the rest is checked 16 bytes at a time with SSE2 where available
+const char *find_special(const char *p, const char *end, int show_all) {
+    if (!show_all) {
+        const char *newline = memchr(p, '\n', end - p);
+        return newline ? newline : end;
+    }
+
+#ifdef __SSE2__
+    // As signed bytes, control characters and bytes >= 0x80 are exactly those below 0x20, DEL is the only other one
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) p);
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(block, space), _mm_cmpeq_epi8(block, del));
+        int mask = _mm_movemask_epi8(special);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+
+    for (; p < end; p++) {
+        unsigned char c = *p;
+        if (c < 0x20 || c >= 0x7f) {
+            return p;
+        }
+    }
+    return end;
+}
+
+int format_flush(Format *format) {
+    int result = write_all(STDOUT_FILENO, format->out, format->used);
+    format->used = 0;
+    return result;
+}
+
+int format_put(Format *format, const char *data, size_t len) {
+    while (len > 0) {
+        if (format->used == FORMAT_BUFFER_SIZE && format_flush(format) != 0) {
+            return -1;
+        }
+        size_t room = FORMAT_BUFFER_SIZE - format->used;
+        size_t n = (len < room) ? len : room;
+        memcpy(format->out + format->used, data, n);
+        format->used += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Writes the line number prefix, six digits wide followed by a tab like cat -n
+int format_number(Format *format) {
+    char prefix[32];
+    int len = snprintf(prefix, sizeof(prefix), "%6lld\t", ++format->line);
+    return format_put(format, prefix, len);
+}
+
+// Writes a nonprinting byte in the ^ and M- notation of cat -A
+int format_nonprinting(Format *format, unsigned char c) {
+    char text[4];
+    int len = 0;
+
+    if (c >= 0x80) {
+        text[len++] = 'M';
+        text[len++] = '-';
+        c -= 0x80;
+    }
+    if (c < 0x20) {
+        text[len++] = '^';
+        text[len++] = c + 64;
+    } else if (c == 0x7f) {
+        text[len++] = '^';
+        text[len++] = '?';
+    } else {
+        text[len++] = c;
+    }
+    return format_put(format, text, len);
+}
+
+// Formats one block of input, jumping between special bytes and copying the runs in between
+int format_block(Format *format, const char *p, const char *end) {
+    while (p < end) {
+        if (format->line_start) {
+            if (*p == '\n') {
+                // Empty line, squeezed if the previous one was empty too
+                format->empty_lines++;
+                if (!(format->squeeze && format->empty_lines > 1)) {
+                    if ((format->number && format_number(format) != 0) ||
+                        (format->show_all && format_put(format, "$", 1) != 0) ||
+                        format_put(format, "\n", 1) != 0) {
+                        return -1;
+                    }
+                }
+                p++;
+                continue;
+            }
+
+            format->empty_lines = 0;
+            format->line_start = 0;
+            if (format->number && format_number(format) != 0) {
+                return -1;
+            }
+        }
+
+        const char *special = find_special(p, end, format->show_all);
+        if (format_put(format, p, special - p) != 0) {
+            return -1;
+        }
+        if (special == end) {
+            break;
+        }
+
+        if (*special == '\n') {
+            if ((format->show_all && format_put(format, "$", 1) != 0) || format_put(format, "\n", 1) != 0) {
+                return -1;
+            }
+            format->line_start = 1;
+        } else if (format_nonprinting(format, *special) != 0) {
+            return -1;
+        }
+        p = special + 1;
+    }
+    return 0;
+}
+
+// Copies one file to stdout through the line-processing options
+int format_fd(Format *format, int fd, char *buffer) {
+    while (1) {
+        ssize_t n = read(fd, buffer, FORMAT_BUFFER_SIZE);
+        if (n == 0) {
+            return 0;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (format_block(format, buffer, buffer + n) != 0) {
+            return -1;
+        }
+    }
+}
+
+// Processes all files with -n, -s or -A, line state carries over from one file to the next like in cat
+int cat_formatted(char **files, int file_count, Format *format) {
+    char *buffer = malloc(FORMAT_BUFFER_SIZE);
+    format->out = malloc(FORMAT_BUFFER_SIZE);
+    if (buffer == NULL || format->out == NULL) {
+        fprintf(stderr, "my-cat: read or write failed\n");
+        return 1;
+    }
+
+    for (int i = 0; i < file_count; i++) {
+        int fd = open(files[i], O_RDONLY);
+        if (fd == -1) {
+            format_flush(format);
+            printf("my-cat: cannot open file\n");
+            return 1;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        if (format_fd(format, fd, buffer) != 0) {
+            fprintf(stderr, "my-cat: read or write failed\n");
+            close(fd);
+            return 1;
+        }
+        close(fd);
+    }
+
+    if (format_flush(format) != 0) {
+        fprintf(stderr, "my-cat: read or write failed\n");
+        return 1;
+    }
+    free(buffer);
+    free(format->out);
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
+    Format format = {0};
+    format.line_start = 1;
+
+    // Collect options and files, files are packed to the front of argv
+    char **files = argv + 1;
+    int file_count = 0;
+    int options_done = 0;
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (!options_done && arg[0] == '-' && arg[1] != '\0') {
+            if (strcmp(arg, "--") == 0) {
+                options_done = 1;
+                continue;
+            }
+            for (int j = 1; arg[j] != '\0'; j++) {
+                switch (arg[j]) {
+                    case 'n': format.number = 1; break;
+                    case 's': format.squeeze = 1; break;
+                    case 'A': format.show_all = 1; break;
+                    default:
+                        printf("usage: my-cat [-nsA] [file...]\n");
+                        return 1;
+                }
+            }
+            continue;
+        }
+        files[file_count++] = arg;
+    }
+
     // If no files are specified, exit 0
-    if (argc == 1) {
+    if (file_count == 0) {
         return 0;
     }
 
+    // Any line-processing option goes through the block formatter, plain concatenation stays zero-copy
+    if (format.number || format.squeeze || format.show_all) {
+        return cat_formatted(files, file_count, &format);
+    }
+
+    Kind out = file_kind(STDOUT_FILENO, NULL);
+
+    // Several files, open and read the upcoming ones while writing the current one
+    if (file_count > 1) {
+        int status = cat_prefetched(files, file_count, out);
+        if (status != -1) {
+            return status;
+        }
+    }
+
     // Process files
-    for (int i = 1; i < argc; i++) {
-        FILE *infile = fopen(argv[i], "r");
-        if (infile == NULL) {
+    for (int i = 0; i < file_count; i++) {
+        int fd = open(files[i], O_RDONLY);
+        if (fd == -1) {
             printf("my-cat: cannot open file\n");
             return 1;
         }
 
-        // Read and print
-        char *line = NULL;
-        size_t len = 0;
-        ssize_t c_count;
-
-        while ((c_count = getline(&line, &len, infile)) != -1) {
-            printf("%s", line);
+        if (cat_fd(fd, NULL, 0, out) != 0) {
+            fprintf(stderr, "my-cat: read or write failed\n");
+            close(fd);
+            return 1;
         }
 
-        free(line);
-        fclose(infile);
+        close(fd);
     }
-    
+
     return 0;
-}
\ No newline at end of file
+}
@@ -1,16 +1,269 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h> 
+#include <stdint.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 // Number of possible characters, this covers extended ASCII
 #define ALPHABET_SIZE 256
+// Initial read buffer for files that cannot be mapped, grows when a single line does not fit
+#define READ_BUFFER_SIZE (4 * 1024 * 1024)
+// Mapped files larger than this are split into chunks searched by different workers with -j
+#define CHUNK_SIZE (8 * 1024 * 1024)
+// Tasks queued or waiting to be written per worker with -j, bounds the memory held by the reorder buffer
+#define TASKS_PER_WORKER 4
+// Aho-Corasick states with a full transition row, 256 rows of 4 bytes each stay in L2 cache
+#define DENSE_STATES 256
+// Most NFA states a regular expression may compile to, bounds repetitions like (a{1000}){1000}
+#define MAX_NFA_STATES 100000
+// Most DFA states cached per thread, about 4 MiB, the cache is flushed and rebuilt when it fills
+#define MAX_DFA_STATES 4096
+// Trigram index kept in each indexed directory by --index-build
+#define INDEX_NAME ".my-grep.idx"
+#define INDEX_TEMP_NAME ".my-grep.idx.tmp"
+#define INDEX_MAGIC "MYGREPI1"
+// Trigrams are three bytes, so a seen-bitmap over all of them is 2 MiB
+#define TRIGRAM_COUNT (1 << 24)
+
+typedef struct Searcher Searcher;
+
+// Finds the first occurrence of the pattern in text, returns a pointer to it or NULL
+typedef const char *(*SearchFunction)(const Searcher *searcher, const char *text, size_t text_len);
+
+typedef struct Matcher Matcher;
+
+// Finds a match in text, returns a pointer into the line holding it or NULL
+typedef const char *(*MatchFunction)(const Matcher *matcher, const char *text, size_t text_len);
+
+// Aho-Corasick automaton for many literal patterns, in a cache-compact layout
+// States are numbered breadth first, so the shallow states that nearly every byte passes through come first
+// The first dense_count states have a full 256-entry transition row, a lookup is a single load
+// Deeper states keep only their own edges and fall back along the failure links until a dense state is reached
+typedef struct {
+    uint32_t state_count;
+    uint32_t dense_count;
+    uint32_t *dense;            // dense_count rows of 256 next states
+    uint32_t *fail;             // Failure link of every state
+    uint32_t *edge_start;       // Edges of sparse state s are edge_start[s] .. edge_start[s + 1] - 1
+    unsigned char *edge_bytes;
+    uint32_t *edge_targets;
+    bool *match;                // Some pattern ends in this state
+} Automaton;
+
+// Search pattern with its Boyer-Moore tables, preprocessed once for the whole run
+struct Searcher {
+    const char *pattern;
+    int pattern_len;
+    bool never_matches;     // A newline inside the pattern can never be part of a single line
+    int bad_char_table[ALPHABET_SIZE];
+    SearchFunction search;  // Fastest search the CPU supports, picked once at startup
+};
+
+// Regular expression syntax tree, built by the parser and compiled to an NFA
+typedef enum {
+    NODE_EMPTY,     // Matches the empty string
+    NODE_SET,       // One byte from a set, literals are single byte sets
+    NODE_CONCAT,
+    NODE_ALT,
+    NODE_REPEAT,    // left repeated min to max times, max -1 for no limit
+    NODE_BOL,       // ^
+    NODE_EOL        // $
+} NodeType;
+
+typedef struct Node {
+    NodeType type;
+    struct Node *left, *right;
+    int min, max;
+    uint8_t set[32];    // Bit per byte for NODE_SET
+} Node;
+
+// Thompson NFA states
+typedef enum {
+    NFA_SET,        // Consume one byte in set and go to out
+    NFA_SPLIT,      // Go to out and out1 without consuming
+    NFA_BOL,        // Go to out at the start of a line
+    NFA_EOL,        // Go to out at the end of a line
+    NFA_MATCH
+} NfaType;
+
+typedef struct {
+    NfaType type;
+    uint32_t out, out1;
+    uint8_t set[32];
+} NfaState;
+
+// Compiled regular expression, shared read-only by all threads
+typedef struct {
+    NfaState *states;
+    uint32_t state_count;
+    uint32_t capacity;
+    uint32_t start;
+} Regex;
+
+// A DFA state is the set of NFA states the input can be in, built the first time it is reached
+typedef struct {
+    uint32_t *nfa;          // Sorted NFA states, only byte sets, end of line assertions and matches
+    uint32_t nfa_count;
+    bool accept;            // A match has been seen on this line
+    bool accept_at_eol;     // A match follows if the line ends here
+    bool dead;              // Nothing can match any more on this line
+    int32_t next[ALPHABET_SIZE];    // Next state per byte, -1 until computed
+} DfaState;
+
+// Lazy DFA, private to each thread, with a bounded number of states
+// Every input byte is one table lookup once its transition is known, and computing a missing one costs
+// time linear in the NFA, so matching stays linear in the input whatever the pattern
+typedef struct {
+    const Regex *regex;
+    DfaState *states;       // MAX_DFA_STATES, flushed when full
+    uint32_t count;
+    int32_t *table;         // Hash table from NFA set to state, -1 empty
+    uint32_t table_size;
+    uint32_t *pool;         // Storage for the NFA sets of all states
+    size_t pool_used, pool_capacity;
+    int32_t start;          // State at the start of a line
+    uint32_t *list, *stack, *mark;  // Scratch space sized to the NFA
+    uint32_t generation;    // Marks the NFA states already in the current closure
+    uint32_t flushes;
+} Dfa;
+
+// The search engine for the whole run, one pattern uses Boyer-Moore, several use Aho-Corasick
+struct Matcher {
+    MatchFunction find;
+    Searcher searcher;      // Single pattern, or the literal every regex match must contain
+    Automaton *automaton;
+    Regex *regex;
+};
+
+// Search patterns collected from -e and -f
+typedef struct {
+    char **items;
+    size_t count;
+    size_t capacity;
+} Patterns;
+
+// Output modes from the command line
+typedef struct {
+    bool count;         // -c, print the number of matching lines per file
+    bool list;          // -l, print the names of files with a match
+    size_t max_count;   // -m, stop a file after this many matching lines, SIZE_MAX for no limit
+    bool show_names;    // Several files, -c prefixes each count with the file name
+} Options;
+
+// Where matching lines go, straight to stdout or into a buffer that is written later in order
+typedef struct {
+    FILE *file;         // stdout, or NULL to collect into data
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool quiet;         // Count matching lines without writing them, for -c and -l
+    size_t limit;       // Stop searching once this many lines have matched
+    size_t matches;     // Matching lines so far
+} Output;
+
+// One piece of work for the -j worker pool, a newline-aligned chunk of a mapped file or a whole unmappable file
+typedef struct {
+    const char *data;   // Chunk to search, or NULL to read fd
+    size_t size;
+    int fd;             // File to read when data is NULL, -1 if it could not be opened
+    void *map;          // Set on the last chunk of a mapping, which is unmapped once that chunk is written
+    size_t map_size;
+    bool done;          // Searched, output is ready to be written
+    int error;          // Reading the file failed, reported when the task's turn comes
+    bool skipped;       // Ruled out by the index, reported as a file without matches
+    const char *name;   // File the task belongs to, set on its last task for -c and -l
+    Output out;
+} Task;
+
+// Ring of tasks in file and chunk order, workers take them in order and the main thread writes them in order
+typedef struct {
+    const Matcher *matcher;
+    const Options *options;
+    Task *tasks;
+    size_t capacity;
+    size_t head;        // Oldest task not yet written
+    size_t next;        // Next task for a worker
+    size_t tail;        // Next free task
+    bool finished;      // No more tasks will be added
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Pool;
+
+// Trigram index file, memory mapped as is
+// Layout: header, files sorted by name, trigrams sorted by value, posting lists of file numbers, file names
+typedef struct {
+    char magic[8];
+    uint32_t file_count;
+    uint32_t trigram_count;
+    uint64_t posting_count;
+    uint64_t names_size;
+} IndexHeader;
+
+typedef struct {
+    uint64_t size;          // Size and modification time when indexed, a file that differs is stale
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t name;          // Offset of the name in the name table
+    uint32_t reserved;
+} IndexFile;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;         // Files containing the trigram
+    uint64_t start;         // First entry in the posting lists, which are sorted by file number
+} IndexTrigram;
+
+typedef struct {
+    void *map;
+    size_t map_size;
+    const IndexHeader *header;
+    const IndexFile *files;
+    const IndexTrigram *trigrams;
+    const uint32_t *postings;
+    const char *names;
+} Index;
+
+// Trigrams a file must contain for the search to have a chance, a file is a candidate if it has all
+// trigrams of at least one alternative
+typedef struct {
+    uint32_t **alternatives;
+    size_t *lengths;
+    size_t count;
+    bool everything;        // Some pattern is too short to filter on, every file is a candidate
+} TrigramFilter;
+
+// Regular file in an indexed directory
+typedef struct {
+    char *name;
+    uint64_t size;
+    struct timespec mtime;
+} DirFile;
+
+// (trigram << 32 | file) pairs collected while building an index, sorted into posting lists
+typedef struct {
+    uint64_t *items;
+    size_t count;
+    size_t capacity;
+} Pairs;
 
 // Implemented Boyer Moore Algorithm to better understand how the actual grep works
 // https://www.geeksforgeeks.org/boyer-moore-algorithm-for-pattern-searching/
 
 // Preprocess the bad character heuristic
-void bad_char_heuristic(char *pattern, int pattern_len, int bad_char_table[ALPHABET_SIZE]) {
+void bad_char_heuristic(const char *pattern, int pattern_len, int bad_char_table[ALPHABET_SIZE]) {
     // Initialize all occurrences as -1
     for (int i = 0; i < ALPHABET_SIZE; i++) {
         bad_char_table[i] = -1;
@@ -22,91 +275,2038 @@ void bad_char_heuristic(char *pattern, int pattern_len, int bad_char_table[ALPHA
     }
 }
 
+// Finds the first occurrence of the pattern in text, returns a pointer to it or NULL
+// text is a whole block of lines, not a single line, so the tables are built once and never per line
+const char *boyer_moore_search(const Searcher *searcher, const char *text, size_t text_len) {
+    const char *pattern = searcher->pattern;
+    size_t pattern_len = searcher->pattern_len;
 
-void boyer_moore_search(char *line, char *pattern) {
-    
-    int line_len = strlen(line);
-    int pattern_len = strlen(pattern);
-    bool found = false;
+    if (text_len < pattern_len) {
+        return NULL;
+    }
 
-    int bad_char_table[ALPHABET_SIZE];
-    bad_char_heuristic(pattern, pattern_len, bad_char_table);
-    
-    // Position in line
-    int shift = 0; 
+    // Position in text
+    size_t shift = 0;
 
-    // Run until remaining line is <= pattern, meaning all matches would've been found
-    while (shift <= (line_len - pattern_len)) {
+    // Run until remaining text is shorter than the pattern
+    while (shift <= text_len - pattern_len) {
         // Start at the last character, matching is done from right to left
         int j = pattern_len - 1;
         // Loop as long as characters match, if a match is found j is -1
-        while (j >= 0 && pattern[j] == line[shift + j]) {
+        while (j >= 0 && pattern[j] == text[shift + j]) {
             j--;
         }
 
-        // Pattern found, print
+        // Pattern found
         if (j < 0) {
-            // Prevents printing the same line multiple times in case multiple matches
-            if (!found) {
-                printf("%s", line);
-                found = true;
-            }
-            // If pattern is longer than line increment shift by 1 to break the while loop
-            // Otherwise we shift to last occurance of next character
-            shift += (shift + pattern_len < line_len) ? pattern_len - bad_char_table[(unsigned char)line[shift + pattern_len]] : 1;
+            return text + shift;
+        }
+
+        // text[shift + j] mismatched character in the text, bad_char_table[...] is the last occurance of the character
+        int bad_char_shift = j - searcher->bad_char_table[(unsigned char) text[shift + j]];
+        // Shifting atleast by 1
+        shift += (bad_char_shift > 1) ? bad_char_shift : 1;
+    }
+    return NULL;
+}
+
+// Single byte patterns, memchr is already vectorised by the C library
+const char *memchr_search(const Searcher *searcher, const char *text, size_t text_len) {
+    return memchr(text, searcher->pattern[0], text_len);
+}
+
+#ifdef HAVE_X86_SIMD
+// Candidate filter on the first and last pattern bytes, in the style of the memchr crate's packed pair search
+// Every position is checked 16 bytes at a time, only positions where both bytes match are verified with memcmp
+// The tail shorter than a vector goes to Boyer-Moore
+__attribute__((target("sse2")))
+const char *sse2_search(const Searcher *searcher, const char *text, size_t text_len) {
+    const char *pattern = searcher->pattern;
+    size_t pattern_len = searcher->pattern_len;
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[pattern_len - 1]);
+    size_t i = 0;
+
+    for (; i + pattern_len - 1 + 16 <= text_len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *) (text + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *) (text + i + pattern_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+
+        while (mask != 0) {
+            size_t candidate = i + __builtin_ctz(mask);
+            // First and last byte already match, a pattern of one or two bytes has nothing in between
+            if (pattern_len <= 2 || memcmp(text + candidate + 1, pattern + 1, pattern_len - 2) == 0) {
+                return text + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return boyer_moore_search(searcher, text + i, text_len - i);
+}
+
+// Same candidate filter 32 bytes at a time
+__attribute__((target("avx2")))
+const char *avx2_search(const Searcher *searcher, const char *text, size_t text_len) {
+    const char *pattern = searcher->pattern;
+    size_t pattern_len = searcher->pattern_len;
+    const __m256i first = _mm256_set1_epi8(pattern[0]);
+    const __m256i last = _mm256_set1_epi8(pattern[pattern_len - 1]);
+    size_t i = 0;
+
+    for (; i + pattern_len - 1 + 32 <= text_len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *) (text + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *) (text + i + pattern_len - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+
+        while (mask != 0) {
+            size_t candidate = i + __builtin_ctz(mask);
+            // First and last byte already match, a pattern of one or two bytes has nothing in between
+            if (pattern_len <= 2 || memcmp(text + candidate + 1, pattern + 1, pattern_len - 2) == 0) {
+                return text + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return boyer_moore_search(searcher, text + i, text_len - i);
+}
+#endif
+
+void searcher_init(Searcher *searcher, const char *pattern) {
+    searcher->pattern = pattern;
+    searcher->pattern_len = strlen(pattern);
+    // Only a newline at the very end can match, it is then the end of the line
+    searcher->never_matches = memchr(pattern, '\n', searcher->pattern_len - 1) != NULL;
+    bad_char_heuristic(pattern, searcher->pattern_len, searcher->bad_char_table);
+
+    // Pick the search at runtime, the same binary runs on CPUs with and without AVX2
+    searcher->search = boyer_moore_search;
+    if (searcher->pattern_len == 1) {
+        searcher->search = memchr_search;
+    }
+#ifdef HAVE_X86_SIMD
+    else if (__builtin_cpu_supports("avx2")) {
+        searcher->search = avx2_search;
+    } else if (__builtin_cpu_supports("sse2")) {
+        searcher->search = sse2_search;
+    }
+#endif
+}
+
+// Single pattern engine
+const char *searcher_find(const Matcher *matcher, const char *text, size_t text_len) {
+    return matcher->searcher.search(&matcher->searcher, text, text_len);
+}
+
+const char *no_match(const Matcher *matcher, const char *text, size_t text_len) {
+    (void) matcher;
+    (void) text;
+    (void) text_len;
+    return NULL;
+}
+
+// Trie node used while building the automaton
+typedef struct {
+    uint32_t first_child;   // 0 means none, the root is never a child
+    uint32_t next_sibling;
+    uint32_t fail;
+    unsigned char byte;     // Edge from the parent
+    bool match;
+} TrieNode;
+
+uint32_t trie_child(const TrieNode *nodes, uint32_t node, unsigned char byte) {
+    for (uint32_t child = nodes[node].first_child; child != 0; child = nodes[child].next_sibling) {
+        if (nodes[child].byte == byte) {
+            return child;
+        }
+    }
+    return 0;
+}
+
+void *checked_malloc(size_t size) {
+    void *pointer = malloc(size ? size : 1);
+    if (pointer == NULL) {
+        printf("my-grep: out of memory\n");
+        exit(1);
+    }
+    return pointer;
+}
+
+// Builds the automaton from a trie of all patterns
+Automaton *automaton_build(char **patterns, size_t pattern_count) {
+    size_t capacity = 1;
+    for (size_t i = 0; i < pattern_count; i++) {
+        capacity += strlen(patterns[i]);
+    }
+
+    // Insert every pattern into the trie
+    TrieNode *nodes = checked_malloc(capacity * sizeof(TrieNode));
+    memset(&nodes[0], 0, sizeof(TrieNode));
+    uint32_t node_count = 1;
+    for (size_t i = 0; i < pattern_count; i++) {
+        uint32_t node = 0;
+        for (const char *c = patterns[i]; *c != '\0'; c++) {
+            uint32_t child = trie_child(nodes, node, *c);
+            if (child == 0) {
+                child = node_count++;
+                memset(&nodes[child], 0, sizeof(TrieNode));
+                nodes[child].byte = *c;
+                nodes[child].next_sibling = nodes[node].first_child;
+                nodes[node].first_child = child;
+            }
+            node = child;
+        }
+        nodes[node].match = true;
+    }
+
+    // Breadth first order gives the failure links and the final state numbers
+    uint32_t *order = checked_malloc(node_count * sizeof(uint32_t));
+    uint32_t *number = checked_malloc(node_count * sizeof(uint32_t));
+    uint32_t head = 0, tail = 0;
+    order[tail++] = 0;
+    nodes[0].fail = 0;
+    while (head < tail) {
+        uint32_t node = order[head++];
+        number[node] = head - 1;
+
+        for (uint32_t child = nodes[node].first_child; child != 0; child = nodes[child].next_sibling) {
+            // The failure link is the longest proper suffix that is also in the trie
+            uint32_t fail = 0;
+            if (node != 0) {
+                fail = nodes[node].fail;
+                while (fail != 0 && trie_child(nodes, fail, nodes[child].byte) == 0) {
+                    fail = nodes[fail].fail;
+                }
+                fail = trie_child(nodes, fail, nodes[child].byte);
+            }
+            nodes[child].fail = fail;
+            // A line matching a suffix pattern matches too
+            nodes[child].match |= nodes[fail].match;
+            order[tail++] = child;
+        }
+    }
+
+    Automaton *automaton = checked_malloc(sizeof(Automaton));
+    automaton->state_count = node_count;
+    automaton->dense_count = node_count < DENSE_STATES ? node_count : DENSE_STATES;
+    automaton->dense = checked_malloc((size_t) automaton->dense_count * ALPHABET_SIZE * sizeof(uint32_t));
+    automaton->fail = checked_malloc(node_count * sizeof(uint32_t));
+    automaton->match = checked_malloc(node_count * sizeof(bool));
+    automaton->edge_start = checked_malloc((node_count + 1) * sizeof(uint32_t));
+    automaton->edge_bytes = checked_malloc(node_count * sizeof(unsigned char));
+    automaton->edge_targets = checked_malloc(node_count * sizeof(uint32_t));
+
+    uint32_t edge_count = 0;
+    for (uint32_t state = 0; state < node_count; state++) {
+        uint32_t node = order[state];
+        automaton->fail[state] = number[nodes[node].fail];
+        automaton->match[state] = nodes[node].match;
+        automaton->edge_start[state] = edge_count;
+
+        if (state < automaton->dense_count) {
+            // Missing edges go where the failure state goes, it is shallower so its row is already done
+            uint32_t *row = &automaton->dense[(size_t) state * ALPHABET_SIZE];
+            for (int c = 0; c < ALPHABET_SIZE; c++) {
+                row[c] = (state == 0) ? 0 : automaton->dense[(size_t) automaton->fail[state] * ALPHABET_SIZE + c];
+            }
+            for (uint32_t child = nodes[node].first_child; child != 0; child = nodes[child].next_sibling) {
+                row[nodes[child].byte] = number[child];
+            }
         } else {
-            // line[shift + j] mismatched character in the line, bad_char_table[...] is the last occurance of the character
-            int bad_char_shift = j - bad_char_table[(unsigned char)line[shift + j]];
-            // Shifting atleast by 1
-            shift += (bad_char_shift > 1) ? bad_char_shift : 1;
+            for (uint32_t child = nodes[node].first_child; child != 0; child = nodes[child].next_sibling) {
+                automaton->edge_bytes[edge_count] = nodes[child].byte;
+                automaton->edge_targets[edge_count] = number[child];
+                edge_count++;
+            }
+        }
+    }
+    automaton->edge_start[node_count] = edge_count;
+
+    free(order);
+    free(number);
+    free(nodes);
+    return automaton;
+}
+
+// Next state after reading byte, following failure links from sparse states
+static inline uint32_t automaton_next(const Automaton *automaton, uint32_t state, unsigned char byte) {
+    while (state >= automaton->dense_count) {
+        for (uint32_t e = automaton->edge_start[state]; e < automaton->edge_start[state + 1]; e++) {
+            if (automaton->edge_bytes[e] == byte) {
+                return automaton->edge_targets[e];
+            }
         }
+        state = automaton->fail[state];
     }
+    return automaton->dense[(size_t) state * ALPHABET_SIZE + byte];
 }
 
+// Multi pattern engine, every byte is read once however many patterns there are
+// Returns the last byte of the first match, patterns have no newlines so that is inside the matching line
+const char *automaton_find(const Matcher *matcher, const char *text, size_t text_len) {
+    const Automaton *automaton = matcher->automaton;
+    uint32_t state = 0;
 
-int main(int argc, char *argv[]) {
-    // Checking for search term
-    if (argc < 2) {
-        printf("my-grep: searchterm [file ...]\n");
+    for (size_t i = 0; i < text_len; i++) {
+        state = automaton_next(automaton, state, text[i]);
+        if (automaton->match[state]) {
+            return text + i;
+        }
+    }
+    return NULL;
+}
+
+// Parser state for one regular expression
+typedef struct {
+    const char *p;
+    bool error;
+} Parser;
+
+Node *new_node(NodeType type, Node *left, Node *right) {
+    Node *node = checked_malloc(sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+void free_node(Node *node) {
+    if (node != NULL) {
+        free_node(node->left);
+        free_node(node->right);
+        free(node);
+    }
+}
+
+void set_add(uint8_t set[32], unsigned char c) {
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+bool set_has(const uint8_t set[32], unsigned char c) {
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+// Adds the bytes of a class like \w or [:alpha:], returns false for an unknown name
+bool set_add_class(uint8_t set[32], const char *name, size_t len) {
+    int (*test)(int) = NULL;
+
+    if (len == 5 && strncmp(name, "alpha", 5) == 0) test = isalpha;
+    else if (len == 5 && strncmp(name, "digit", 5) == 0) test = isdigit;
+    else if (len == 5 && strncmp(name, "alnum", 5) == 0) test = isalnum;
+    else if (len == 5 && strncmp(name, "space", 5) == 0) test = isspace;
+    else if (len == 5 && strncmp(name, "upper", 5) == 0) test = isupper;
+    else if (len == 5 && strncmp(name, "lower", 5) == 0) test = islower;
+    else if (len == 5 && strncmp(name, "punct", 5) == 0) test = ispunct;
+    else if (len == 5 && strncmp(name, "blank", 5) == 0) test = isblank;
+    else if (len == 5 && strncmp(name, "cntrl", 5) == 0) test = iscntrl;
+    else if (len == 5 && strncmp(name, "print", 5) == 0) test = isprint;
+    else if (len == 5 && strncmp(name, "graph", 5) == 0) test = isgraph;
+    else if (len == 6 && strncmp(name, "xdigit", 6) == 0) test = isxdigit;
+    else return false;
+
+    for (int c = 0; c < 128; c++) {
+        if (test(c)) {
+            set_add(set, c);
+        }
+    }
+    return true;
+}
+
+// Turns a set into its complement
+void set_negate(uint8_t set[32]) {
+    for (int i = 0; i < 32; i++) {
+        set[i] = ~set[i];
+    }
+}
+
+Node *parse_alternation(Parser *parser);
+
+// Parses a bracket expression after the opening [
+Node *parse_bracket(Parser *parser) {
+    Node *node = new_node(NODE_SET, NULL, NULL);
+    bool negate = false;
+
+    if (*parser->p == '^') {
+        negate = true;
+        parser->p++;
+    }
+
+    // A ] right at the start is a literal
+    bool first = true;
+    while (*parser->p != '\0' && (*parser->p != ']' || first)) {
+        first = false;
+
+        if (parser->p[0] == '[' && parser->p[1] == ':') {
+            const char *close = strstr(parser->p + 2, ":]");
+            if (close == NULL || !set_add_class(node->set, parser->p + 2, close - parser->p - 2)) {
+                parser->error = true;
+                return node;
+            }
+            parser->p = close + 2;
+            continue;
+        }
+
+        unsigned char low = *parser->p++;
+        if (low == '\\' && *parser->p != '\0') {
+            low = *parser->p++;
+        }
+        unsigned char high = low;
+        if (parser->p[0] == '-' && parser->p[1] != ']' && parser->p[1] != '\0') {
+            parser->p++;
+            high = *parser->p++;
+            if (high == '\\' && *parser->p != '\0') {
+                high = *parser->p++;
+            }
+            if (high < low) {
+                parser->error = true;
+                return node;
+            }
+        }
+        for (int c = low; c <= high; c++) {
+            set_add(node->set, c);
+        }
+    }
+
+    if (*parser->p != ']') {
+        parser->error = true;
+        return node;
+    }
+    parser->p++;
+
+    if (negate) {
+        set_negate(node->set);
+    }
+    return node;
+}
+
+// Parses a single atom: a literal, ., a class, an anchor or a group
+Node *parse_atom(Parser *parser) {
+    char c = *parser->p++;
+    Node *node;
+
+    switch (c) {
+        case '(':
+            node = parse_alternation(parser);
+            if (*parser->p != ')') {
+                parser->error = true;
+                return node;
+            }
+            parser->p++;
+            return node;
+        case '[':
+            return parse_bracket(parser);
+        case '.':
+            node = new_node(NODE_SET, NULL, NULL);
+            memset(node->set, 0xff, sizeof(node->set));
+            return node;
+        case '^':
+            return new_node(NODE_BOL, NULL, NULL);
+        case '$':
+            return new_node(NODE_EOL, NULL, NULL);
+        case '\\':
+            node = new_node(NODE_SET, NULL, NULL);
+            c = *parser->p;
+            if (c == '\0') {
+                parser->error = true;
+                return node;
+            }
+            parser->p++;
+            if (c == 'w' || c == 'W') {
+                set_add_class(node->set, "alnum", 5);
+                set_add(node->set, '_');
+            } else if (c == 's' || c == 'S') {
+                set_add_class(node->set, "space", 5);
+            } else if (c == 'd' || c == 'D') {
+                set_add_class(node->set, "digit", 5);
+            } else {
+                set_add(node->set, c);
+                return node;
+            }
+            if (isupper((unsigned char) c)) {
+                set_negate(node->set);
+            }
+            return node;
+        default:
+            node = new_node(NODE_SET, NULL, NULL);
+            set_add(node->set, c);
+            return node;
+    }
+}
+
+// Parses {m}, {m,} or {m,n} after an atom, returns false if the brace does not start a valid repetition
+bool parse_braces(Parser *parser, int *min, int *max) {
+    const char *p = parser->p + 1;
+    char *end;
+
+    if (!isdigit((unsigned char) *p)) {
+        return false;
+    }
+    long low = strtol(p, &end, 10);
+    long high = low;
+    p = end;
+    if (*p == ',') {
+        p++;
+        high = -1;
+        if (isdigit((unsigned char) *p)) {
+            high = strtol(p, &end, 10);
+            p = end;
+        }
+    }
+    if (*p != '}' || low > 1000 || high > 1000 || (high != -1 && high < low)) {
+        return false;
+    }
+
+    parser->p = p + 1;
+    *min = low;
+    *max = high;
+    return true;
+}
+
+// Parses an atom followed by any number of *, +, ? and {m,n}
+Node *parse_repeat(Parser *parser) {
+    Node *node = parse_atom(parser);
+
+    while (!parser->error) {
+        int min, max;
+        char c = *parser->p;
+
+        if (c == '*') {
+            min = 0;
+            max = -1;
+            parser->p++;
+        } else if (c == '+') {
+            min = 1;
+            max = -1;
+            parser->p++;
+        } else if (c == '?') {
+            min = 0;
+            max = 1;
+            parser->p++;
+        } else if (c != '{' || !parse_braces(parser, &min, &max)) {
+            break;
+        }
+
+        node = new_node(NODE_REPEAT, node, NULL);
+        node->min = min;
+        node->max = max;
+    }
+    return node;
+}
+
+Node *parse_concatenation(Parser *parser) {
+    Node *node = NULL;
+
+    while (!parser->error && *parser->p != '\0' && *parser->p != '|' && *parser->p != ')') {
+        Node *next = parse_repeat(parser);
+        node = (node == NULL) ? next : new_node(NODE_CONCAT, node, next);
+    }
+    return node ? node : new_node(NODE_EMPTY, NULL, NULL);
+}
+
+Node *parse_alternation(Parser *parser) {
+    Node *node = parse_concatenation(parser);
+
+    while (!parser->error && *parser->p == '|') {
+        parser->p++;
+        node = new_node(NODE_ALT, node, parse_concatenation(parser));
+    }
+    return node;
+}
+
+// Parses a whole pattern, prints an error and exits on invalid syntax
+Node *parse_regex(const char *pattern) {
+    Parser parser = { pattern, false };
+    Node *node = parse_alternation(&parser);
+
+    if (parser.error || *parser.p != '\0') {
+        printf("my-grep: invalid regular expression\n");
         exit(1);
     }
+    return node;
+}
 
-    char *search = argv[1];
+uint32_t nfa_add(Regex *regex, NfaType type, uint32_t out, uint32_t out1) {
+    if (regex->state_count == MAX_NFA_STATES) {
+        printf("my-grep: regular expression too large\n");
+        exit(1);
+    }
+    if (regex->state_count == regex->capacity) {
+        regex->capacity = regex->capacity ? regex->capacity * 2 : 64;
+        NfaState *temp = realloc(regex->states, regex->capacity * sizeof(NfaState));
+        if (temp == NULL) {
+            printf("my-grep: out of memory\n");
+            exit(1);
+        }
+        regex->states = temp;
+    }
 
-    // If search term is empty, match nothing and exit
-    if (strlen(search) == 0) {
-        exit(0);
+    NfaState *state = &regex->states[regex->state_count];
+    memset(state, 0, sizeof(NfaState));
+    state->type = type;
+    state->out = out;
+    state->out1 = out1;
+    return regex->state_count++;
+}
+
+// Compiles a node so that a match of it continues at next, returns the entry state
+// Building back to front means every fragment already knows where it goes, no patch lists are needed
+uint32_t nfa_compile(Regex *regex, const Node *node, uint32_t next) {
+    uint32_t state;
+
+    switch (node->type) {
+        case NODE_EMPTY:
+            return next;
+        case NODE_SET:
+            state = nfa_add(regex, NFA_SET, next, 0);
+            memcpy(regex->states[state].set, node->set, 32);
+            // Lines never contain their newline
+            regex->states[state].set['\n' >> 3] &= ~(1 << ('\n' & 7));
+            return state;
+        case NODE_CONCAT:
+            return nfa_compile(regex, node->left, nfa_compile(regex, node->right, next));
+        case NODE_ALT: {
+            uint32_t left = nfa_compile(regex, node->left, next);
+            uint32_t right = nfa_compile(regex, node->right, next);
+            return nfa_add(regex, NFA_SPLIT, left, right);
+        }
+        case NODE_BOL:
+            return nfa_add(regex, NFA_BOL, next, 0);
+        case NODE_EOL:
+            return nfa_add(regex, NFA_EOL, next, 0);
+        case NODE_REPEAT: {
+            uint32_t entry = next;
+            if (node->max == -1) {
+                // Loop: a split that either runs the body again or leaves
+                uint32_t loop = nfa_add(regex, NFA_SPLIT, 0, next);
+                regex->states[loop].out = nfa_compile(regex, node->left, loop);
+                entry = loop;
+            } else {
+                // Optional copies, each one may leave straight to next
+                for (int i = node->min; i < node->max; i++) {
+                    uint32_t body = nfa_compile(regex, node->left, entry);
+                    entry = nfa_add(regex, NFA_SPLIT, body, next);
+                }
+            }
+            // Required copies
+            for (int i = 0; i < node->min; i++) {
+                entry = nfa_compile(regex, node->left, entry);
+            }
+            return entry;
+        }
     }
+    return next;
+}
 
-    char *line = NULL;
-    size_t len = 0;
-    FILE *file = NULL;
+// Returns the single byte of a set, or -1 if the set has zero or several bytes
+int set_single_byte(const uint8_t set[32]) {
+    int found = -1;
+    for (int c = 0; c < ALPHABET_SIZE; c++) {
+        if (set_has(set, c)) {
+            if (found != -1) {
+                return -1;
+            }
+            found = c;
+        }
+    }
+    return found;
+}
 
-    // If only search term is provided, read from standard input
-    if (argc == 2) {
-        while(getline(&line, &len, stdin) != -1) {
-            if (strstr(line, search) != NULL) {
-                printf("%s", line);
+// Finds the longest literal every match of node must contain, written to best
+// Only concatenations and repetitions of at least one are followed, alternations contribute nothing
+void required_literal(const Node *node, char *run, size_t *run_len, char *best, size_t *best_len) {
+    switch (node->type) {
+        case NODE_SET: {
+            int c = set_single_byte(node->set);
+            if (c >= 0 && c != '\n') {
+                run[(*run_len)++] = c;
+                if (*run_len > *best_len) {
+                    memcpy(best, run, *run_len);
+                    *best_len = *run_len;
+                }
+                return;
             }
+            break;
         }
-    } else {
-        // Process each file passed as an argument
-        for (int i = 2; i < argc; i++) {
-            file = fopen(argv[i], "r");
-            if (file == NULL) {
-                printf("my-grep: cannot open file\n");
-                free(line);
-                exit(1);
+        case NODE_CONCAT:
+            required_literal(node->left, run, run_len, best, best_len);
+            required_literal(node->right, run, run_len, best, best_len);
+            return;
+        case NODE_EMPTY:
+        case NODE_BOL:
+        case NODE_EOL:
+            // Zero width, a literal run continues across them
+            return;
+        case NODE_REPEAT:
+            if (node->min >= 1) {
+                // The body appears at least once, but what comes after it may not follow a complete run
+                size_t inner_len = 0;
+                required_literal(node->left, run + *run_len, &inner_len, best, best_len);
+            }
+            break;
+        default:
+            break;
+    }
+    *run_len = 0;
+}
+
+// Each thread has its own DFA cache, the compiled regex itself is shared
+static __thread Dfa *thread_dfa = NULL;
+
+// Adds the states reachable from state without consuming input to dfa->list
+// at_bol lets ^ pass, at_eol lets $ pass, states are marked when pushed so the stack never outgrows the NFA
+void dfa_closure(Dfa *dfa, uint32_t state, bool at_bol, bool at_eol, uint32_t *count) {
+    const NfaState *nfa = dfa->regex->states;
+    uint32_t top = 0;
+
+    if (dfa->mark[state] == dfa->generation) {
+        return;
+    }
+    dfa->mark[state] = dfa->generation;
+    dfa->stack[top++] = state;
+
+    while (top > 0) {
+        uint32_t s = dfa->stack[--top];
+        uint32_t follow[2];
+        int follow_count = 0;
+
+        switch (nfa[s].type) {
+            case NFA_SPLIT:
+                follow[follow_count++] = nfa[s].out;
+                follow[follow_count++] = nfa[s].out1;
+                break;
+            case NFA_BOL:
+                if (at_bol) {
+                    follow[follow_count++] = nfa[s].out;
+                }
+                break;
+            case NFA_EOL:
+                if (at_eol) {
+                    follow[follow_count++] = nfa[s].out;
+                } else {
+                    dfa->list[(*count)++] = s;
+                }
+                break;
+            default:
+                dfa->list[(*count)++] = s;
+                break;
+        }
+
+        for (int i = 0; i < follow_count; i++) {
+            if (dfa->mark[follow[i]] != dfa->generation) {
+                dfa->mark[follow[i]] = dfa->generation;
+                dfa->stack[top++] = follow[i];
             }
-            while(getline(&line, &len, file) != -1) {
-                boyer_moore_search(line, search);
+        }
+    }
+}
+
+int compare_uint32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+uint32_t hash_set(const uint32_t *set, uint32_t count) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < count; i++) {
+        hash = (hash ^ set[i]) * 16777619u;
+    }
+    return hash;
+}
 
+// Drops every cached state, used when the cache is full
+void dfa_flush(Dfa *dfa) {
+    dfa->count = 0;
+    dfa->flushes++;
+    dfa->pool_used = 0;
+    memset(dfa->table, 0xff, dfa->table_size * sizeof(int32_t));
+    dfa->start = -1;
+}
+
+// Returns the state for the NFA set in dfa->list, adding it if it is new
+int32_t dfa_state(Dfa *dfa, uint32_t count) {
+    qsort(dfa->list, count, sizeof(uint32_t), compare_uint32);
+
+    uint32_t slot = hash_set(dfa->list, count) & (dfa->table_size - 1);
+    while (dfa->table[slot] != -1) {
+        DfaState *existing = &dfa->states[dfa->table[slot]];
+        if (existing->nfa_count == count && memcmp(existing->nfa, dfa->list, count * sizeof(uint32_t)) == 0) {
+            return dfa->table[slot];
+        }
+        slot = (slot + 1) & (dfa->table_size - 1);
+    }
+
+    // Full, start over, the set to add is still in dfa->list
+    if (dfa->count == MAX_DFA_STATES || dfa->pool_used + count > dfa->pool_capacity) {
+        dfa_flush(dfa);
+        return dfa_state(dfa, count);
+    }
+
+    int32_t index = dfa->count++;
+    DfaState *state = &dfa->states[index];
+    state->nfa = dfa->pool + dfa->pool_used;
+    state->nfa_count = count;
+    memcpy(state->nfa, dfa->list, count * sizeof(uint32_t));
+    dfa->pool_used += count;
+    memset(state->next, 0xff, sizeof(state->next));
+    dfa->table[slot] = index;
+
+    // Classify the state, a match seen, or a match if the line ends here
+    const NfaState *nfa = dfa->regex->states;
+    state->accept = false;
+    state->accept_at_eol = false;
+    state->dead = (count == 0);
+    for (uint32_t i = 0; i < count; i++) {
+        if (nfa[state->nfa[i]].type == NFA_MATCH) {
+            state->accept = true;
+        }
+    }
+    state->accept_at_eol = state->accept;
+    dfa->generation++;
+    for (uint32_t i = 0; i < count && !state->accept_at_eol; i++) {
+        if (nfa[state->nfa[i]].type == NFA_EOL) {
+            // Reuse the scratch list past the current set, it is not needed any more
+            uint32_t found = 0;
+            uint32_t *saved = dfa->list;
+            dfa->list = dfa->stack + dfa->regex->state_count;
+            dfa_closure(dfa, nfa[state->nfa[i]].out, false, true, &found);
+            for (uint32_t j = 0; j < found; j++) {
+                if (nfa[dfa->list[j]].type == NFA_MATCH) {
+                    state->accept_at_eol = true;
+                }
             }
-            fclose(file);
+            dfa->list = saved;
         }
     }
+    return index;
+}
+
+// State at the start of a line, rebuilt after a flush
+int32_t dfa_start(Dfa *dfa) {
+    if (dfa->start == -1) {
+        uint32_t count = 0;
+        dfa->generation++;
+        dfa_closure(dfa, dfa->regex->start, true, false, &count);
+        dfa->start = dfa_state(dfa, count);
+    }
+    return dfa->start;
+}
 
-    free(line);
-    return 0;
+// Computes and caches the transition of state on byte
+// The pattern may start anywhere in the line, so the start of the NFA is added after every byte
+int32_t dfa_transition(Dfa *dfa, int32_t state, unsigned char byte) {
+    const NfaState *nfa = dfa->regex->states;
+    DfaState *from = &dfa->states[state];
+    uint32_t count = 0;
+
+    dfa->generation++;
+    for (uint32_t i = 0; i < from->nfa_count; i++) {
+        const NfaState *s = &nfa[from->nfa[i]];
+        if (s->type == NFA_SET && set_has(s->set, byte)) {
+            dfa_closure(dfa, s->out, false, false, &count);
+        }
+    }
+    dfa_closure(dfa, dfa->regex->start, false, false, &count);
+
+    uint32_t flushes = dfa->flushes;
+    int32_t next = dfa_state(dfa, count);
+    // A flush reuses the slot of the old state, so only link the transition if there was none
+    if (dfa->flushes == flushes) {
+        from->next[byte] = next;
+    }
+    return next;
+}
+
+Dfa *dfa_create(const Regex *regex) {
+    Dfa *dfa = checked_malloc(sizeof(Dfa));
+    dfa->regex = regex;
+    dfa->states = checked_malloc(MAX_DFA_STATES * sizeof(DfaState));
+    dfa->table_size = 2 * MAX_DFA_STATES;
+    dfa->table = checked_malloc(dfa->table_size * sizeof(int32_t));
+    dfa->pool_capacity = (size_t) 16 * MAX_DFA_STATES + regex->state_count;
+    dfa->pool = checked_malloc(dfa->pool_capacity * sizeof(uint32_t));
+    dfa->list = checked_malloc(regex->state_count * sizeof(uint32_t));
+    // The stack is followed by a second list used while classifying states
+    dfa->stack = checked_malloc(2 * regex->state_count * sizeof(uint32_t));
+    dfa->mark = checked_malloc(regex->state_count * sizeof(uint32_t));
+    memset(dfa->mark, 0, regex->state_count * sizeof(uint32_t));
+    dfa->generation = 0;
+    dfa->flushes = 0;
+    dfa_flush(dfa);
+    return dfa;
+}
+
+void dfa_free(Dfa *dfa) {
+    if (dfa != NULL) {
+        free(dfa->states);
+        free(dfa->table);
+        free(dfa->pool);
+        free(dfa->list);
+        free(dfa->stack);
+        free(dfa->mark);
+        free(dfa);
+    }
+}
+
+// Regular expression engine without a usable literal, the DFA reads every byte
+// Returns a pointer into the first matching line, or NULL
+const char *regex_find(const Matcher *matcher, const char *text, size_t text_len) {
+    if (thread_dfa == NULL) {
+        thread_dfa = dfa_create(matcher->regex);
+    }
+    Dfa *dfa = thread_dfa;
+    const char *p = text;
+    const char *end = text + text_len;
+    int32_t state = dfa_start(dfa);
+
+    while (p < end) {
+        // Newlines, accepting and dead states never get a cached transition, so this loop only stops for them
+        // and for transitions not computed yet
+        int32_t next;
+        while ((next = dfa->states[state].next[(unsigned char) *p]) >= 0) {
+            state = next;
+            if (++p == end) {
+                break;
+            }
+        }
+        if (p == end) {
+            break;
+        }
+
+        const DfaState *current = &dfa->states[state];
+        if (current->accept) {
+            return p;
+        }
+
+        unsigned char c = *p;
+        if (c == '\n') {
+            if (current->accept_at_eol) {
+                return p;
+            }
+            state = dfa_start(dfa);
+            p++;
+            continue;
+        }
+
+        // Nothing can match on this line any more, go straight to the next one
+        if (current->dead) {
+            p = memchr(p, '\n', end - p);
+            if (p == NULL) {
+                return NULL;
+            }
+            continue;
+        }
+
+        state = dfa_transition(dfa, state, c);
+        p++;
+    }
+
+    // Last line without a newline
+    if (text_len > 0 && end[-1] != '\n' && (dfa->states[state].accept || dfa->states[state].accept_at_eol)) {
+        return end - 1;
+    }
+    return NULL;
+}
+
+// Regular expression engine with a required literal, only lines containing the literal are run through the DFA
+const char *regex_find_prefiltered(const Matcher *matcher, const char *text, size_t text_len) {
+    const char *p = text;
+    const char *end = text + text_len;
+    const char *candidate;
+
+    while (p < end && (candidate = matcher->searcher.search(&matcher->searcher, p, end - p)) != NULL) {
+        const char *line_start = memrchr(p, '\n', candidate - p);
+        line_start = line_start ? line_start + 1 : p;
+        const char *line_end = memchr(candidate, '\n', end - candidate);
+        line_end = line_end ? line_end + 1 : end;
 
-}
\ No newline at end of file
+        if (regex_find(matcher, line_start, line_end - line_start) != NULL) {
+            return candidate;
+        }
+        p = line_end;
+    }
+    return NULL;
+}
+
+// Compiles all patterns as one alternation and picks the literal prefilter if there is one
+void matcher_init_regex(Matcher *matcher, char **patterns, size_t pattern_count) {
+    Node *root = NULL;
+    for (size_t i = 0; i < pattern_count; i++) {
+        Node *node = parse_regex(patterns[i]);
+        root = (root == NULL) ? node : new_node(NODE_ALT, root, node);
+    }
+
+    Regex *regex = checked_malloc(sizeof(Regex));
+    memset(regex, 0, sizeof(Regex));
+    uint32_t match = nfa_add(regex, NFA_MATCH, 0, 0);
+    regex->start = nfa_compile(regex, root, match);
+    matcher->regex = regex;
+    matcher->find = regex_find;
+
+    // A literal of two or more bytes is rare enough to be worth searching for first
+    size_t len = strlen(patterns[0]);
+    char *run = checked_malloc(len + 1);
+    char *best = checked_malloc(len + 1);
+    size_t run_len = 0, best_len = 0;
+    required_literal(root, run, &run_len, best, &best_len);
+    if (best_len >= 2) {
+        best[best_len] = '\0';
+        searcher_init(&matcher->searcher, best);
+        matcher->find = regex_find_prefiltered;
+    } else {
+        free(best);
+    }
+    free(run);
+    free_node(root);
+}
+
+// Picks the engine, a lazy DFA for regular expressions, Boyer-Moore for a single literal and Aho-Corasick for several
+void matcher_init(Matcher *matcher, char **patterns, size_t pattern_count, bool extended) {
+    memset(matcher, 0, sizeof(*matcher));
+
+    if (pattern_count == 0) {
+        // Only empty patterns, which match nothing in my-grep
+        matcher->find = no_match;
+    } else if (extended) {
+        matcher_init_regex(matcher, patterns, pattern_count);
+    } else if (pattern_count == 1) {
+        searcher_init(&matcher->searcher, patterns[0]);
+        matcher->find = matcher->searcher.never_matches ? no_match : searcher_find;
+    } else {
+        matcher->automaton = automaton_build(patterns, pattern_count);
+        matcher->find = automaton_find;
+    }
+}
+
+// Appends to an output, returns false when out of memory
+bool output_write(Output *out, const char *data, size_t len) {
+    if (out->file != NULL) {
+        fwrite(data, 1, len, out->file);
+        return true;
+    }
+
+    if (out->length + len > out->capacity) {
+        size_t capacity = out->capacity ? out->capacity * 2 : 64 * 1024;
+        while (capacity < out->length + len) {
+            capacity *= 2;
+        }
+        char *temp = realloc(out->data, capacity);
+        if (temp == NULL) {
+            return false;
+        }
+        out->data = temp;
+        out->capacity = capacity;
+    }
+    memcpy(out->data + out->length, data, len);
+    out->length += len;
+    return true;
+}
+
+// Prepares an output for a new file according to -c, -l and -m
+void output_start(Output *out, const Options *options) {
+    out->matches = 0;
+    out->quiet = options->count || options->list;
+    out->limit = options->max_count;
+    // One match is enough to list a file, -l wins over -c
+    if (options->list && out->limit > 1) {
+        out->limit = 1;
+    }
+}
+
+bool output_full(const Output *out) {
+    return out->matches >= out->limit;
+}
+
+// Prints the count or name of a searched file for -c and -l, after its lines
+void output_report(Output *out, const Options *options, const char *name, size_t matches) {
+    char line[64];
+
+    if (options->list) {
+        if (matches > 0) {
+            output_write(out, name, strlen(name));
+            output_write(out, "\n", 1);
+        }
+    } else if (options->count) {
+        if (options->show_names) {
+            output_write(out, name, strlen(name));
+            output_write(out, ":", 1);
+        }
+        int len = snprintf(line, sizeof(line), "%zu\n", matches);
+        output_write(out, line, len);
+    }
+}
+
+// Prints every line of a block of whole lines that contains a pattern
+// The search runs over the whole block, each match is expanded to its line, which is printed once,
+// and the search continues after that line, so regions without matches are skipped without looking at line breaks
+// Stops as soon as the output has reached its limit of matching lines
+void grep_block(const Matcher *matcher, const char *data, size_t size, Output *out) {
+    const char *p = data;
+    const char *end = data + size;
+    const char *match;
+
+    while (p < end && !output_full(out) && (match = matcher->find(matcher, p, end - p)) != NULL) {
+        const char *line_start = memrchr(p, '\n', match - p);
+        line_start = line_start ? line_start + 1 : p;
+        const char *line_end = memchr(match, '\n', end - match);
+        line_end = line_end ? line_end + 1 : end;
+
+        out->matches++;
+        if (!out->quiet && !output_write(out, line_start, line_end - line_start)) {
+            printf("my-grep: out of memory\n");
+            exit(1);
+        }
+        p = line_end;
+    }
+}
+
+// Maps a regular file, returns NULL if it is empty or not a regular file
+char *map_file(int fd, size_t *size) {
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return NULL;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return data;
+}
+
+// Searches a file that cannot be mapped
+// It is read into a large buffer that is searched up to its last newline, the partial line is carried over
+// Returns 0 on success, -1 on a read error
+int grep_stream(const Matcher *matcher, int fd, Output *out) {
+    size_t capacity = READ_BUFFER_SIZE;
+    size_t filled = 0;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    // Stop reading once enough lines have matched
+    while (!output_full(out)) {
+        // A single line fills the whole buffer, make room for the rest of it
+        if (filled == capacity) {
+            char *temp = realloc(buffer, capacity * 2);
+            if (temp == NULL) {
+                free(buffer);
+                return -1;
+            }
+            buffer = temp;
+            capacity *= 2;
+        }
+
+        ssize_t n = read(fd, buffer + filled, capacity - filled);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return -1;
+        }
+        if (n == 0) {
+            // Last line without a newline
+            grep_block(matcher, buffer, filled, out);
+            break;
+        }
+
+        // Search the complete lines, keep the partial one for the next read
+        const char *last_newline = memrchr(buffer + filled, '\n', n);
+        filled += n;
+        if (last_newline != NULL) {
+            size_t complete = last_newline - buffer + 1;
+            grep_block(matcher, buffer, complete, out);
+            memmove(buffer, buffer + complete, filled - complete);
+            filled -= complete;
+        }
+    }
+
+    free(buffer);
+    return 0;
+}
+
+// Searches an open file, regular files are mapped and searched in one go
+// Returns 0 on success, -1 on a read error
+int grep_fd(const Matcher *matcher, int fd, Output *out) {
+    size_t size;
+    char *data = map_file(fd, &size);
+
+    if (data == NULL) {
+        return grep_stream(matcher, fd, out);
+    }
+    grep_block(matcher, data, size, out);
+    munmap(data, size);
+    return 0;
+}
+
+// Worker thread for -j, searches tasks in order into their own output buffers
+void *pool_worker(void *arg) {
+    Pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->next == pool->tail && !pool->finished) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (pool->next == pool->tail) {
+            break;
+        }
+        Task *task = &pool->tasks[pool->next % pool->capacity];
+        pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (task->skipped) {
+            // Nothing to search
+        } else if (task->data != NULL) {
+            grep_block(pool->matcher, task->data, task->size, &task->out);
+        } else if (task->fd != -1) {
+            if (grep_stream(pool->matcher, task->fd, &task->out) != 0) {
+                task->error = 1;
+            }
+            close(task->fd);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        task->done = true;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    dfa_free(thread_dfa);
+    thread_dfa = NULL;
+    return NULL;
+}
+
+// Writes the oldest task once it is done, errors are reported at the same point a sequential run would hit them
+void pool_write_oldest(Pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    Task *task = &pool->tasks[pool->head % pool->capacity];
+    while (!task->done) {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (task->out.length > 0) {
+        fwrite(task->out.data, 1, task->out.length, stdout);
+    }
+    if (task->fd == -1 && task->data == NULL && !task->skipped) {
+        printf("my-grep: cannot open file\n");
+        exit(1);
+    }
+    if (task->error) {
+        printf("my-grep: cannot read file\n");
+        exit(1);
+    }
+    if (task->name != NULL) {
+        Output report = { .file = stdout };
+        output_report(&report, pool->options, task->name, task->out.matches);
+    }
+    free(task->out.data);
+    if (task->map != NULL) {
+        munmap(task->map, task->map_size);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->head++;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Queues a task, first writing finished tasks while the ring is full
+Task *pool_add(Pool *pool) {
+    while (pool->tail - pool->head == pool->capacity) {
+        pool_write_oldest(pool);
+    }
+    Task *task = &pool->tasks[pool->tail % pool->capacity];
+    memset(task, 0, sizeof(Task));
+    task->fd = -1;
+    output_start(&task->out, pool->options);
+    return task;
+}
+
+void pool_commit(Pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->tail++;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Searches files with a pool of workers, output comes out in the same order as a sequential run
+// Different files are searched at the same time, and large mapped files are split into newline-aligned chunks
+// With -c, -l or -m a file has to be searched in order to know when to stop, so files are not split
+// Files marked in skipped, which may be NULL, are not opened and count as files without matches
+void grep_parallel(const Matcher *matcher, const Options *options, char **files, const bool *skipped,
+                   int file_count, int workers) {
+    bool whole_files = options->count || options->list || options->max_count != SIZE_MAX;
+    Pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.matcher = matcher;
+    pool.options = options;
+    pool.capacity = (size_t) workers * TASKS_PER_WORKER;
+    pool.tasks = malloc(pool.capacity * sizeof(Task));
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    if (pool.tasks == NULL || threads == NULL) {
+        printf("my-grep: out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+
+    int started = 0;
+    for (int t = 0; t < workers; t++) {
+        if (pthread_create(&threads[started], NULL, pool_worker, &pool) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        printf("my-grep: cannot start worker threads\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < file_count; i++) {
+        if (skipped != NULL && skipped[i]) {
+            Task *task = pool_add(&pool);
+            task->skipped = true;
+            task->name = files[i];
+            pool_commit(&pool);
+            continue;
+        }
+
+        int fd = open(files[i], O_RDONLY);
+        size_t size = 0;
+        char *data = (fd == -1) ? NULL : map_file(fd, &size);
+
+        if (data == NULL) {
+            // Could not be opened or mapped, one task reads the whole file
+            Task *task = pool_add(&pool);
+            task->fd = fd;
+            task->name = files[i];
+            pool_commit(&pool);
+            continue;
+        }
+        close(fd);
+
+        // Chunks end right after a newline, so every line is searched by exactly one worker
+        size_t start = 0;
+        while (start < size) {
+            size_t end = size;
+            if (size - start > CHUNK_SIZE && !whole_files) {
+                const char *newline = memchr(data + start + CHUNK_SIZE - 1, '\n', size - start - CHUNK_SIZE + 1);
+                end = newline ? (size_t) (newline - data) + 1 : size;
+            }
+
+            Task *task = pool_add(&pool);
+            task->data = data + start;
+            task->size = end - start;
+            if (end == size) {
+                task->map = data;
+                task->map_size = size;
+                task->name = files[i];
+            }
+            pool_commit(&pool);
+            start = end;
+        }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.finished = true;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+
+    while (pool.head != pool.tail) {
+        pool_write_oldest(&pool);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    free(pool.tasks);
+}
+
+
+int compare_dir_files(const void *a, const void *b) {
+    return strcmp(((const DirFile *) a)->name, ((const DirFile *) b)->name);
+}
+
+// Lists the regular files directly in dir sorted by name, the index itself is left out
+DirFile *list_directory(const char *dir, size_t *count) {
+    DIR *stream = opendir(dir);
+    if (stream == NULL) {
+        printf("my-grep: cannot open directory\n");
+        exit(1);
+    }
+
+    DirFile *files = NULL;
+    size_t capacity = 0;
+    struct dirent *entry;
+    *count = 0;
+    while ((entry = readdir(stream)) != NULL) {
+        struct stat st;
+        if (strcmp(entry->d_name, INDEX_NAME) == 0 || strcmp(entry->d_name, INDEX_TEMP_NAME) == 0 ||
+            fstatat(dirfd(stream), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            DirFile *temp = realloc(files, capacity * sizeof(DirFile));
+            if (temp == NULL) {
+                printf("my-grep: out of memory\n");
+                exit(1);
+            }
+            files = temp;
+        }
+        files[*count].name = strdup(entry->d_name);
+        files[*count].size = st.st_size;
+        files[*count].mtime = st.st_mtim;
+        if (files[*count].name == NULL) {
+            printf("my-grep: out of memory\n");
+            exit(1);
+        }
+        (*count)++;
+    }
+    closedir(stream);
+
+    qsort(files, *count, sizeof(DirFile), compare_dir_files);
+    return files;
+}
+
+// Joins a directory and a file name into a new string
+char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    char *path = checked_malloc(dir_len + strlen(name) + 2);
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    strcpy(path + dir_len + 1, name);
+    return path;
+}
+
+// Maps the index of dir, returns false if there is none or it is damaged
+bool index_open(Index *index, const char *dir) {
+    char *path = join_path(dir, INDEX_NAME);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) {
+        return false;
+    }
+    size_t size = 0;
+    char *data = map_file(fd, &size);
+    close(fd);
+    if (data == NULL) {
+        return false;
+    }
+
+    // Every section has to fit in the file before anything points into it
+    const IndexHeader *header = (const IndexHeader *) data;
+    if (size >= sizeof(IndexHeader) && memcmp(header->magic, INDEX_MAGIC, 8) == 0) {
+        uint64_t files_end = sizeof(IndexHeader) + (uint64_t) header->file_count * sizeof(IndexFile);
+        uint64_t trigrams_end = files_end + (uint64_t) header->trigram_count * sizeof(IndexTrigram);
+        uint64_t postings_end = trigrams_end + header->posting_count * sizeof(uint32_t);
+        // Names are NUL terminated, so the table has to end in one
+        if (header->posting_count <= size && header->names_size <= size && postings_end + header->names_size == size &&
+            (header->names_size == 0 || data[size - 1] == '\0')) {
+            index->map = data;
+            index->map_size = size;
+            index->header = header;
+            index->files = (const IndexFile *) (data + sizeof(IndexHeader));
+            index->trigrams = (const IndexTrigram *) (data + files_end);
+            index->postings = (const uint32_t *) (data + trigrams_end);
+            index->names = data + postings_end;
+            return true;
+        }
+    }
+    munmap(data, size);
+    return false;
+}
+
+void index_close(Index *index) {
+    munmap(index->map, index->map_size);
+}
+
+// Returns the number of the file with this name in the index, or -1
+int64_t index_find_file(const Index *index, const char *name) {
+    size_t low = 0, high = index->header->file_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        uint32_t offset = index->files[mid].name;
+        int cmp = (offset < index->header->names_size) ? strcmp(index->names + offset, name) : 1;
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return -1;
+}
+
+// A file is fresh when its size and modification time are the ones it was indexed with
+bool index_fresh(const IndexFile *indexed, const DirFile *file) {
+    return indexed->size == file->size && indexed->mtime_sec == file->mtime.tv_sec &&
+           indexed->mtime_nsec == file->mtime.tv_nsec;
+}
+
+// Returns the posting list of a trigram, NULL if no file contains it
+const IndexTrigram *index_find_trigram(const Index *index, uint32_t trigram) {
+    size_t low = 0, high = index->header->trigram_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (index->trigrams[mid].trigram == trigram) {
+            const IndexTrigram *found = &index->trigrams[mid];
+            return (found->start + found->count <= index->header->posting_count) ? found : NULL;
+        }
+        if (index->trigrams[mid].trigram < trigram) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+// Returns true if the indexed file contains the trigram
+bool index_has(const Index *index, uint32_t trigram, uint32_t file) {
+    const IndexTrigram *entry = index_find_trigram(index, trigram);
+    if (entry == NULL) {
+        return false;
+    }
+    const uint32_t *list = index->postings + entry->start;
+    size_t low = 0, high = entry->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (list[mid] == file) {
+            return true;
+        }
+        if (list[mid] < file) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return false;
+}
+
+void pairs_add(Pairs *pairs, uint32_t trigram, uint32_t file) {
+    if (pairs->count == pairs->capacity) {
+        pairs->capacity = pairs->capacity ? pairs->capacity * 2 : 1 << 16;
+        uint64_t *temp = realloc(pairs->items, pairs->capacity * sizeof(uint64_t));
+        if (temp == NULL) {
+            printf("my-grep: out of memory\n");
+            exit(1);
+        }
+        pairs->items = temp;
+    }
+    pairs->items[pairs->count++] = (uint64_t) trigram << 32 | file;
+}
+
+// Adds every distinct trigram of data for file, trigrams across a newline are left out since no line contains them
+// seen is a bitmap over all trigrams, it is cleared again before returning
+void index_scan(const char *data, size_t size, uint32_t file, uint64_t *seen, Pairs *pairs) {
+    size_t first = pairs->count;
+    uint32_t trigram = 0;
+    size_t run = 0;     // Bytes since the last newline
+
+    for (size_t i = 0; i < size; i++) {
+        unsigned char c = data[i];
+        if (c == '\n') {
+            run = 0;
+            continue;
+        }
+        trigram = ((trigram << 8) | c) & (TRIGRAM_COUNT - 1);
+        if (++run >= 3 && !(seen[trigram >> 6] & (1ULL << (trigram & 63)))) {
+            seen[trigram >> 6] |= 1ULL << (trigram & 63);
+            pairs_add(pairs, trigram, file);
+        }
+    }
+
+    for (size_t i = first; i < pairs->count; i++) {
+        uint32_t added = pairs->items[i] >> 32;
+        seen[added >> 6] &= ~(1ULL << (added & 63));
+    }
+}
+
+int compare_uint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Writes the index file, first to a temporary name that replaces the old index in one rename
+void index_write(const char *dir, const DirFile *files, size_t file_count, const Pairs *pairs) {
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 8);
+    header.file_count = file_count;
+    header.posting_count = pairs->count;
+    for (size_t i = 0; i < pairs->count; i++) {
+        if (i == 0 || pairs->items[i] >> 32 != pairs->items[i - 1] >> 32) {
+            header.trigram_count++;
+        }
+    }
+    for (size_t i = 0; i < file_count; i++) {
+        header.names_size += strlen(files[i].name) + 1;
+    }
+
+    char *temp_path = join_path(dir, INDEX_TEMP_NAME);
+    FILE *out = fopen(temp_path, "w");
+    if (out == NULL) {
+        printf("my-grep: cannot write index\n");
+        exit(1);
+    }
+    fwrite(&header, sizeof(header), 1, out);
+
+    uint32_t name = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        IndexFile entry = { files[i].size, files[i].mtime.tv_sec, files[i].mtime.tv_nsec, name, 0 };
+        fwrite(&entry, sizeof(entry), 1, out);
+        name += strlen(files[i].name) + 1;
+    }
+
+    for (size_t i = 0; i < pairs->count; ) {
+        IndexTrigram entry = { pairs->items[i] >> 32, 0, i };
+        while (i < pairs->count && pairs->items[i] >> 32 == entry.trigram) {
+            entry.count++;
+            i++;
+        }
+        fwrite(&entry, sizeof(entry), 1, out);
+    }
+
+    for (size_t i = 0; i < pairs->count; i++) {
+        uint32_t file = (uint32_t) pairs->items[i];
+        fwrite(&file, sizeof(file), 1, out);
+    }
+
+    for (size_t i = 0; i < file_count; i++) {
+        fwrite(files[i].name, 1, strlen(files[i].name) + 1, out);
+    }
+
+    if (fclose(out) != 0) {
+        printf("my-grep: cannot write index\n");
+        exit(1);
+    }
+    char *path = join_path(dir, INDEX_NAME);
+    if (rename(temp_path, path) != 0) {
+        printf("my-grep: cannot write index\n");
+        exit(1);
+    }
+    free(path);
+    free(temp_path);
+}
+
+// Builds or refreshes the trigram index of the files directly in dir
+// Files whose size and modification time did not change keep their trigrams from the old index, only the others are read
+void index_build(const char *dir) {
+    size_t file_count;
+    DirFile *files = list_directory(dir, &file_count);
+    Pairs pairs = {0};
+
+    Index old;
+    bool have_old = index_open(&old, dir);
+    uint32_t *old_to_new = NULL;
+    if (have_old) {
+        old_to_new = checked_malloc((old.header->file_count + 1) * sizeof(uint32_t));
+        memset(old_to_new, 0xff, (old.header->file_count + 1) * sizeof(uint32_t));
+    }
+
+    uint64_t *seen = calloc(TRIGRAM_COUNT / 64, sizeof(uint64_t));
+    if (seen == NULL) {
+        printf("my-grep: out of memory\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < file_count; i++) {
+        if (have_old) {
+            int64_t indexed = index_find_file(&old, files[i].name);
+            if (indexed >= 0 && index_fresh(&old.files[indexed], &files[i])) {
+                old_to_new[indexed] = i;
+                continue;
+            }
+        }
+
+        char *path = join_path(dir, files[i].name);
+        int fd = open(path, O_RDONLY);
+        free(path);
+        if (fd == -1) {
+            printf("my-grep: cannot open file\n");
+            exit(1);
+        }
+        size_t size = 0;
+        char *data = map_file(fd, &size);
+        if (data != NULL) {
+            index_scan(data, size, i, seen, &pairs);
+            munmap(data, size);
+        } else if (files[i].size > 0) {
+            printf("my-grep: cannot read file\n");
+            exit(1);
+        }
+        close(fd);
+    }
+    free(seen);
+
+    // Carry over the posting lists of unchanged files under their new numbers
+    if (have_old) {
+        for (uint32_t t = 0; t < old.header->trigram_count; t++) {
+            const IndexTrigram *entry = &old.trigrams[t];
+            if (entry->start + entry->count > old.header->posting_count) {
+                continue;
+            }
+            for (uint32_t j = 0; j < entry->count; j++) {
+                uint32_t file = old.postings[entry->start + j];
+                if (file < old.header->file_count && old_to_new[file] != UINT32_MAX) {
+                    pairs_add(&pairs, entry->trigram, old_to_new[file]);
+                }
+            }
+        }
+        free(old_to_new);
+        index_close(&old);
+    }
+
+    qsort(pairs.items, pairs.count, sizeof(uint64_t), compare_uint64);
+    index_write(dir, files, file_count, &pairs);
+
+    free(pairs.items);
+    for (size_t i = 0; i < file_count; i++) {
+        free(files[i].name);
+    }
+    free(files);
+}
+
+// Adds a literal every match of one alternative contains
+void filter_add(TrigramFilter *filter, const char *literal, size_t len) {
+    if (len < 3) {
+        filter->everything = true;
+        return;
+    }
+
+    uint32_t *trigrams = checked_malloc((len - 2) * sizeof(uint32_t));
+    size_t count = 0;
+    for (size_t i = 0; i + 2 < len; i++) {
+        trigrams[count++] = (unsigned char) literal[i] << 16 | (unsigned char) literal[i + 1] << 8 |
+                            (unsigned char) literal[i + 2];
+    }
+
+    filter->alternatives = realloc(filter->alternatives, (filter->count + 1) * sizeof(uint32_t *));
+    filter->lengths = realloc(filter->lengths, (filter->count + 1) * sizeof(size_t));
+    if (filter->alternatives == NULL || filter->lengths == NULL) {
+        printf("my-grep: out of memory\n");
+        exit(1);
+    }
+    filter->alternatives[filter->count] = trigrams;
+    filter->lengths[filter->count] = count;
+    filter->count++;
+}
+
+// Builds the filter from what the matcher must find
+// Literal patterns are used whole, a regular expression only through the literal its prefilter searches for
+void filter_init(TrigramFilter *filter, const Matcher *matcher, const Patterns *patterns, bool extended) {
+    memset(filter, 0, sizeof(*filter));
+
+    if (extended) {
+        if (matcher->find == regex_find_prefiltered) {
+            filter_add(filter, matcher->searcher.pattern, matcher->searcher.pattern_len);
+        } else {
+            filter->everything = true;
+        }
+        return;
+    }
+    for (size_t i = 0; i < patterns->count; i++) {
+        filter_add(filter, patterns->items[i], strlen(patterns->items[i]));
+    }
+}
+
+// Returns true if the indexed file may contain a match
+bool filter_match(const TrigramFilter *filter, const Index *index, uint32_t file) {
+    if (filter->everything) {
+        return true;
+    }
+    for (size_t a = 0; a < filter->count; a++) {
+        bool all = true;
+        for (size_t i = 0; i < filter->lengths[a] && all; i++) {
+            uint32_t trigram = filter->alternatives[a][i];
+            // A trigram with a newline is in no line, and an alternative containing one never matches
+            all = ((trigram >> 16) & 0xff) != '\n' && ((trigram >> 8) & 0xff) != '\n' && (trigram & 0xff) != '\n' &&
+                  index_has(index, trigram, file);
+        }
+        if (all) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Lists the files of an indexed directory for a search, files the index rules out are marked in skipped
+// Files that are new or changed since the index was built are always searched, without an index all of them are
+char **index_query(const char *dir, const Matcher *matcher, const Patterns *patterns, bool extended,
+                   bool **skipped, int *file_count) {
+    size_t count;
+    DirFile *files = list_directory(dir, &count);
+    char **paths = checked_malloc((count + 1) * sizeof(char *));
+    *skipped = checked_malloc((count + 1) * sizeof(bool));
+
+    Index index;
+    bool have_index = index_open(&index, dir);
+    TrigramFilter filter;
+    filter_init(&filter, matcher, patterns, extended);
+
+    for (size_t i = 0; i < count; i++) {
+        paths[i] = join_path(dir, files[i].name);
+        (*skipped)[i] = false;
+        if (have_index) {
+            int64_t indexed = index_find_file(&index, files[i].name);
+            if (indexed >= 0 && index_fresh(&index.files[indexed], &files[i])) {
+                (*skipped)[i] = !filter_match(&filter, &index, indexed);
+            }
+        }
+        free(files[i].name);
+    }
+    free(files);
+
+    for (size_t a = 0; a < filter.count; a++) {
+        free(filter.alternatives[a]);
+    }
+    free(filter.alternatives);
+    free(filter.lengths);
+    if (have_index) {
+        index_close(&index);
+    }
+
+    *file_count = count;
+    return paths;
+}
+
+// Adds the patterns in text, one per line like grep -e and -f
+// Empty patterns are dropped, an empty search term matches nothing in my-grep
+void add_patterns(Patterns *patterns, const char *text, size_t len) {
+    const char *end = text + len;
+
+    while (text < end) {
+        const char *newline = memchr(text, '\n', end - text);
+        const char *line_end = newline ? newline : end;
+
+        if (line_end > text) {
+            if (patterns->count == patterns->capacity) {
+                patterns->capacity = patterns->capacity ? patterns->capacity * 2 : 16;
+                char **temp = realloc(patterns->items, patterns->capacity * sizeof(char *));
+                if (temp == NULL) {
+                    printf("my-grep: out of memory\n");
+                    exit(1);
+                }
+                patterns->items = temp;
+            }
+            patterns->items[patterns->count++] = strndup(text, line_end - text);
+        }
+        text = line_end + 1;
+    }
+}
+
+// Reads a -f patterns file
+void read_pattern_file(Patterns *patterns, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        printf("my-grep: cannot open file\n");
+        exit(1);
+    }
+
+    Output contents = { .file = NULL };
+    char buffer[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("my-grep: cannot read file\n");
+            exit(1);
+        }
+        if (!output_write(&contents, buffer, n)) {
+            printf("my-grep: out of memory\n");
+            exit(1);
+        }
+    }
+    close(fd);
+
+    add_patterns(patterns, contents.data, contents.length);
+    free(contents.data);
+}
+
+void usage(void) {
+    printf("my-grep: [-E] [-c] [-l] [-m N] [-j N] [--index DIR] {searchterm | -e pattern... | -f file...} [file ...]\n");
+    printf("my-grep: --index-build DIR\n");
+    exit(1);
+}
+
+// Searches one open file sequentially and prints its lines, count or name
+void grep_file(const Matcher *matcher, const Options *options, int fd, const char *name) {
+    Output out = { .file = stdout };
+    output_start(&out, options);
+    if (grep_fd(matcher, fd, &out) != 0) {
+        printf("my-grep: cannot read file\n");
+        exit(1);
+    }
+    output_report(&out, options, name, out.matches);
+}
+
+// Matches -j and -m, alone with the number in the next argument or with the digits attached (-j4)
+// Anything else starting with the letter, like -mistake, is not the option and can be a search term
+bool is_number_option(const char *arg, char letter) {
+    if (arg[0] != '-' || arg[1] != letter) {
+        return false;
+    }
+    for (const char *c = arg + 2; *c != '\0'; c++) {
+        if (*c < '0' || *c > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int workers = 1;
+    int arg = 1;
+    Patterns patterns = {0};
+    bool pattern_options = false;  // -e or -f given, so there is no positional search term
+    bool extended = false;         // -E, patterns are regular expressions
+    Options options = { .max_count = SIZE_MAX };
+    const char *index_dir = NULL;  // --index, search the files of this directory through its index
+
+    // Options come before the search term, anything that is not a known option is the search term
+    // -- ends the options, so a search term that looks like an option can still be given
+    while (arg < argc) {
+        if (is_number_option(argv[arg], 'j')) {
+            const char *value = argv[arg][2] ? argv[arg] + 2 : (arg + 1 < argc ? argv[++arg] : "");
+            char *end = NULL;
+            long n = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || n < 1 || n > 1024) {
+                usage();
+            }
+            workers = n;
+            arg++;
+        } else if (is_number_option(argv[arg], 'm')) {
+            const char *value = argv[arg][2] ? argv[arg] + 2 : (arg + 1 < argc ? argv[++arg] : "");
+            char *end = NULL;
+            long long n = strtoll(value, &end, 10);
+            if (end == value || *end != '\0' || n < 0) {
+                usage();
+            }
+            options.max_count = n;
+            arg++;
+        } else if (strcmp(argv[arg], "-e") == 0 || strcmp(argv[arg], "-f") == 0) {
+            bool is_file = argv[arg][1] == 'f';
+            if (arg + 1 >= argc) {
+                usage();
+            }
+            const char *value = argv[++arg];
+            if (is_file) {
+                read_pattern_file(&patterns, value);
+            } else {
+                add_patterns(&patterns, value, strlen(value));
+            }
+            pattern_options = true;
+            arg++;
+        } else if (strcmp(argv[arg], "-E") == 0) {
+            extended = true;
+            arg++;
+        } else if (strcmp(argv[arg], "--index-build") == 0) {
+            // Only builds the index, no search
+            if (arg + 2 != argc) {
+                usage();
+            }
+            index_build(argv[arg + 1]);
+            return 0;
+        } else if (strcmp(argv[arg], "--index") == 0) {
+            if (arg + 1 >= argc) {
+                usage();
+            }
+            index_dir = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "-c") == 0) {
+            options.count = true;
+            arg++;
+        } else if (strcmp(argv[arg], "-l") == 0) {
+            options.list = true;
+            arg++;
+        } else if (strcmp(argv[arg], "--") == 0) {
+            arg++;
+            break;
+        } else {
+            break;
+        }
+    }
+
+    if (!pattern_options) {
+        // Checking for search term
+        if (arg >= argc) {
+            printf("my-grep: searchterm [file ...]\n");
+            exit(1);
+        }
+
+        // The search term is taken as is, a newline in it can never match
+        // An empty search term matches nothing
+        if (strlen(argv[arg]) > 0) {
+            patterns.items = &argv[arg];
+            patterns.count = 1;
+        }
+        arg++;
+    }
+
+    char **files = argv + arg;
+    int file_count = argc - arg;
+    bool *skipped = NULL;
+
+    // With an index the files are the ones in its directory
+    if (index_dir != NULL && file_count > 0) {
+        usage();
+    }
+
+    // Nothing can match, and there are no counts to print
+    if ((patterns.count == 0 || options.max_count == 0) && (!options.count || options.list)) {
+        exit(0);
+    }
+
+    // Pattern tables are built once for all files, standard input goes through the same block search
+    Matcher matcher;
+    matcher_init(&matcher, patterns.items, patterns.count, extended);
+
+    if (index_dir != NULL) {
+        files = index_query(index_dir, &matcher, &patterns, extended, &skipped, &file_count);
+        if (file_count == 0) {
+            return 0;
+        }
+    }
+    options.show_names = file_count > 1;
+
+    // If no files are given, read from standard input
+    if (file_count == 0) {
+        grep_file(&matcher, &options, STDIN_FILENO, "(standard input)");
+        return 0;
+    }
+
+    if (workers > 1) {
+        grep_parallel(&matcher, &options, files, skipped, file_count, workers);
+        return 0;
+    }
+
+    // Process each file passed as an argument
+    for (int i = 0; i < file_count; i++) {
+        if (skipped != NULL && skipped[i]) {
+            Output out = { .file = stdout };
+            output_report(&out, &options, files[i], 0);
+            continue;
+        }
+
+        int fd = open(files[i], O_RDONLY);
+        if (fd == -1) {
+            printf("my-grep: cannot open file\n");
+            exit(1);
+        }
+        grep_file(&matcher, &options, fd, files[i]);
+        close(fd);
+    }
+
+    return 0;
+
+}
@@ -1,38 +1,920 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Compact format written by my-zip -c, see my-zip.c
+#define COMPACT_MAGIC "\x89RLZ"
+#define COMPACT_VERSION 1
+// Compressed input is read in blocks of this size
+#define READ_SIZE (1024 * 1024)
+// Decoded bytes are collected into a buffer of this size and written in one go
+#define OUTPUT_SIZE (4 * 1024 * 1024)
+// Runs at least this long are spliced into a pipe from a constant region instead of being copied
+#define SPLICE_SIZE (128 * 1024)
+// Pipe size asked for when stdout is a pipe, so one vmsplice call moves a whole region
+#define PIPE_SIZE (1024 * 1024)
+// Block index written by my-zip -i, see my-zip.c
+#define INDEX_MAGIC "RLZINDEX"
+#define FOOTER_SIZE 24
+// Archive written by my-zip -a, see my-zip.c
+#define ARCHIVE_MAGIC "\x89RLA"
+#define ARCHIVE_VERSION 1
+#define TABLE_MAGIC "RLAFILES"
+// Offset, compressed size, size and name length of a member table entry
+#define MEMBER_SIZE 28
+// Blocks decoded in memory by -j workers at most, larger ones are decoded straight to the output in turn
+#define MAX_BLOCK_SIZE (64 * 1024 * 1024)
+// Blocks queued or waiting to be written per worker with -j
+#define TASKS_PER_WORKER 4
+
+// Compressed input, records may cross block boundaries so the unread tail is kept at the front on refill
+typedef struct {
+    int fd;                     // -1 when data already holds all of the input
+    unsigned char *data;
+    size_t start;
+    size_t end;
+} Reader;
+
+// Output buffer, runs are expanded with memset and the buffer is written when full
+typedef struct {
+    int fd;                     // -1 for a buffer that has to hold the whole output
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool pipe;                  // stdout is a pipe, long runs go through vmsplice
+    unsigned char *regions[256];    // SPLICE_SIZE copies of each byte, created on first use and never changed
+    bool limited;               // Only part of the output is wanted, for --range and index blocks
+    uint64_t skip;              // Bytes still to drop before the wanted part
+    uint64_t remaining;         // Bytes still wanted, decoding stops at 0
+} Writer;
+
+// Where decoding can start, see my-zip.c
+typedef struct {
+    uint64_t uncompressed;
+    uint64_t compressed;
+} IndexEntry;
+
+typedef struct {
+    IndexEntry *entries;
+    uint64_t count;
+    uint64_t total;             // Uncompressed size
+    uint64_t end;               // Where the index starts, compressed data ends before it
+} BlockIndex;
+
+// One file of an archive, name points into the loaded member table and is not terminated
+typedef struct {
+    const char *name;
+    uint32_t name_length;
+    uint64_t offset;
+    uint64_t compressed;
+    uint64_t size;
+} Member;
+
+typedef struct {
+    char *table;                // Member table as stored, names point into it
+    Member *members;
+    uint64_t count;
+} Archive;
+
+// One block for the -j worker pool, decoded into its own buffer
+typedef struct {
+    uint64_t compressed;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    bool direct;                // Too large to hold, the main thread decodes it when its turn comes
+    bool done;
+    int error;
+    char *output;
+} Task;
+
+// Ring of blocks in file order, workers decode them in order and the main thread writes them in order
+typedef struct {
+    int fd;
+    bool compact;
+    Task *tasks;
+    size_t capacity;
+    size_t head;                // Oldest block not yet written
+    size_t next;                // Next block for a worker
+    size_t tail;                // Next free slot
+    bool finished;              // No more blocks will be added
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Pool;
+
+void truncated(void) {
+    fprintf(stderr, "my-unzip: truncated input\n");
+    exit(1);
+}
+
+void corrupt_archive(void) {
+    fprintf(stderr, "my-unzip: corrupt archive\n");
+    exit(1);
+}
+
+// Makes at least need bytes available, returns false if the input ends first
+bool reader_fill(Reader *reader, size_t need) {
+    if (reader->end - reader->start >= need) {
+        return true;
+    }
+    if (reader->fd == -1) {
+        return false;
+    }
+
+    memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+    while (reader->end < need) {
+        ssize_t n = read(reader->fd, reader->data + reader->end, READ_SIZE - reader->end);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "my-unzip: read failed\n");
+            exit(1);
+        }
+        if (n == 0) {
+            return false;
+        }
+        reader->end += n;
+    }
+    return true;
+}
+
+// Reads an LEB128 varint, at most 10 bytes
+uint64_t reader_varint(Reader *reader) {
+    uint64_t value = 0;
+    int shift = 0;
+
+    // Near the end of the input fewer than 10 bytes may be left, the loop checks each one
+    reader_fill(reader, 10);
+    while (1) {
+        if (reader->start == reader->end || shift > 63) {
+            truncated();
+        }
+        unsigned char c = reader->data[reader->start++];
+        value |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return value;
+        }
+        shift += 7;
+    }
+}
+
+// Writes the whole buffer, retrying short writes
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void writer_flush(Writer *writer) {
+    if (writer->fd == -1) {
+        // A block decoded to more than the index says
+        fprintf(stderr, "my-unzip: corrupt block index\n");
+        exit(1);
+    }
+    if (write_all(writer->fd, writer->data, writer->length) != 0) {
+        fprintf(stderr, "my-unzip: write failed\n");
+        exit(1);
+    }
+    writer->length = 0;
+}
+
+// Hands count bytes of a constant region to the pipe without copying them
+// Returns the number of bytes spliced, 0 if vmsplice cannot be used and the run has to be copied
+uint64_t writer_splice(Writer *writer, unsigned char byte, uint64_t count) {
+    if (writer->regions[byte] == NULL) {
+        void *region;
+        if (posix_memalign(&region, 4096, SPLICE_SIZE) != 0) {
+            return 0;
+        }
+        memset(region, byte, SPLICE_SIZE);
+        writer->regions[byte] = region;
+    }
+
+    uint64_t done = 0;
+    while (count - done >= SPLICE_SIZE) {
+        struct iovec iov = { writer->regions[byte], SPLICE_SIZE };
+        while (iov.iov_len > 0) {
+            ssize_t n = vmsplice(writer->fd, &iov, 1, 0);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EINVAL || errno == EBADF || errno == ENOSYS) {
+                    // Not a pipe after all, write what is left of the region and copy from now on
+                    writer->pipe = false;
+                    if (write_all(writer->fd, iov.iov_base, iov.iov_len) != 0) {
+                        fprintf(stderr, "my-unzip: write failed\n");
+                        exit(1);
+                    }
+                    return done + SPLICE_SIZE;
+                }
+                fprintf(stderr, "my-unzip: write failed\n");
+                exit(1);
+            }
+            iov.iov_base = (char *) iov.iov_base + n;
+            iov.iov_len -= n;
+        }
+        done += SPLICE_SIZE;
+    }
+    return done;
+}
+
+// All wanted bytes have been written
+static inline bool writer_done(const Writer *writer) {
+    return writer->limited && writer->remaining == 0;
+}
+
+// Drops the bytes before the wanted part and cuts off the ones after it
+// Returns how many of count bytes are kept, *dropped is how many were dropped in front
+uint64_t writer_clip(Writer *writer, uint64_t count, uint64_t *dropped) {
+    *dropped = 0;
+    if (!writer->limited) {
+        return count;
+    }
+    if (writer->skip > 0) {
+        *dropped = (count < writer->skip) ? count : writer->skip;
+        writer->skip -= *dropped;
+        count -= *dropped;
+    }
+    if (count > writer->remaining) {
+        count = writer->remaining;
+    }
+    writer->remaining -= count;
+    return count;
+}
+
+// Expands a run into the output buffer
+void writer_run(Writer *writer, unsigned char byte, uint64_t count) {
+    uint64_t dropped;
+    count = writer_clip(writer, count, &dropped);
+
+    if (writer->pipe && count >= SPLICE_SIZE) {
+        // Bytes already in the buffer come first
+        writer_flush(writer);
+        count -= writer_splice(writer, byte, count);
+    }
+
+    while (count > 0) {
+        if (writer->length == writer->capacity) {
+            writer_flush(writer);
+        }
+        size_t n = writer->capacity - writer->length;
+        if (n > count) {
+            n = count;
+        }
+        memset(writer->data + writer->length, byte, n);
+        writer->length += n;
+        count -= n;
+    }
+}
+
+// Copies literal bytes from the input to the output buffer
+void writer_literal(Writer *writer, Reader *reader, uint64_t count) {
+    uint64_t dropped;
+    count = writer_clip(writer, count, &dropped);
+
+    // Bytes before the wanted part are read past
+    while (dropped > 0) {
+        if (reader->start == reader->end && !reader_fill(reader, 1)) {
+            truncated();
+        }
+        size_t n = reader->end - reader->start;
+        if (n > dropped) {
+            n = dropped;
+        }
+        reader->start += n;
+        dropped -= n;
+    }
+
+    while (count > 0) {
+        if (reader->start == reader->end && !reader_fill(reader, 1)) {
+            truncated();
+        }
+        if (writer->length == writer->capacity) {
+            writer_flush(writer);
+        }
+        size_t n = reader->end - reader->start;
+        if (n > writer->capacity - writer->length) {
+            n = writer->capacity - writer->length;
+        }
+        if (n > count) {
+            n = count;
+        }
+        memcpy(writer->data + writer->length, reader->data + reader->start, n);
+        writer->length += n;
+        reader->start += n;
+        count -= n;
+    }
+}
+
+// Decodes 5-byte records, 4-byte int count and the character, a partial record at the end is ignored
+void unzip_legacy(Reader *reader, Writer *writer) {
+    while (!writer_done(writer) && reader_fill(reader, 5)) {
+        // Decode every whole record in the buffer before refilling
+        while (reader->end - reader->start >= 5 && !writer_done(writer)) {
+            int count;
+            memcpy(&count, reader->data + reader->start, sizeof(int));
+            unsigned char character = reader->data[reader->start + 4];
+            reader->start += 5;
+            // Data without runs is mostly single bytes, store them without a memset call
+            if (count == 1 && writer->length < writer->capacity && !writer->limited) {
+                writer->data[writer->length++] = character;
+            } else if (count > 0) {
+                writer_run(writer, character, count);
+            }
+        }
+    }
+}
+
+// Decodes compact records after the header, up to the zero that ends them
+void unzip_compact(Reader *reader, Writer *writer) {
+    while (!writer_done(writer)) {
+        uint64_t value = reader_varint(reader);
+        if (value == 0) {
+            return;
+        }
+
+        if (value & 1) {
+            // Run of one byte
+            if (!reader_fill(reader, 1)) {
+                truncated();
+            }
+            writer_run(writer, reader->data[reader->start++], value >> 1);
+        } else {
+            // Literal bytes, copied as they are
+            writer_literal(writer, reader, value >> 1);
+        }
+    }
+}
+
+// Reads bytes at an offset, returns false if there are fewer
+bool read_at(int fd, void *data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, data, len, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data = (char *) data + n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Reads the trailer bytes that end at offset end, in the legacy format every byte is its own zero-count record
+bool read_trailer(int fd, bool compact, void *data, size_t len, uint64_t end) {
+    if (compact) {
+        return end >= len && read_at(fd, data, len, end - len);
+    }
+
+    uint64_t size = (uint64_t) len * 5;
+    if (end < size) {
+        return false;
+    }
+    unsigned char *records = malloc(size);
+    if (records == NULL || !read_at(fd, records, size, end - size)) {
+        free(records);
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        int count;
+        memcpy(&count, records + i * 5, sizeof(int));
+        if (count != 0) {
+            free(records);
+            return false;
+        }
+        ((unsigned char *) data)[i] = records[i * 5 + 4];
+    }
+    free(records);
+    return true;
+}
+
+// Loads the block index at the end of a file, returns false if there is none
+bool read_index(int fd, bool compact, BlockIndex *index) {
+    struct stat st;
+    unsigned char footer[FOOTER_SIZE];
+    size_t scale = compact ? 1 : 5;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        !read_trailer(fd, compact, footer, FOOTER_SIZE, st.st_size) || memcmp(footer + 16, INDEX_MAGIC, 8) != 0) {
+        return false;
+    }
+    memcpy(&index->count, footer, 8);
+    memcpy(&index->total, footer + 8, 8);
+
+    uint64_t footer_end = st.st_size - FOOTER_SIZE * scale;
+    if (index->count > footer_end / (sizeof(IndexEntry) * scale)) {
+        return false;
+    }
+    index->end = footer_end - index->count * sizeof(IndexEntry) * scale;
+    index->entries = malloc(index->count * sizeof(IndexEntry) + 1);
+    if (index->entries == NULL ||
+        !read_trailer(fd, compact, index->entries, index->count * sizeof(IndexEntry), footer_end)) {
+        free(index->entries);
+        return false;
+    }
+
+    // Entries have to grow and stay inside the data, or they cannot be trusted
+    for (uint64_t i = 0; i < index->count; i++) {
+        const IndexEntry *entry = &index->entries[i];
+        if (entry->compressed > index->end || entry->uncompressed > index->total ||
+            (i > 0 && (entry->uncompressed <= entry[-1].uncompressed || entry->compressed <= entry[-1].compressed))) {
+            free(index->entries);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Detects the format from the first 5 bytes
+bool is_compact(int fd) {
+    unsigned char header[5];
+    return read_at(fd, header, sizeof(header), 0) && memcmp(header, COMPACT_MAGIC, 4) == 0 &&
+           header[4] == COMPACT_VERSION;
+}
+
+bool is_archive(int fd) {
+    unsigned char header[5];
+    return read_at(fd, header, sizeof(header), 0) && memcmp(header, ARCHIVE_MAGIC, 4) == 0 &&
+           header[4] == ARCHIVE_VERSION;
+}
+
+// Decodes from a compressed offset until the writer has what it wants or the records end
+void unzip_from(int fd, bool compact, uint64_t offset, Reader *reader, Writer *writer) {
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        fprintf(stderr, "my-unzip: read failed\n");
+        exit(1);
+    }
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+    if (compact) {
+        unzip_compact(reader, writer);
+    } else {
+        unzip_legacy(reader, writer);
+    }
+}
+
+// Loads the member table at the end of an archive, the records of every member have to lie before it
+void read_archive(int fd, Archive *archive) {
+    struct stat st;
+    unsigned char footer[FOOTER_SIZE];
+    uint64_t table;
+
+    if (fstat(fd, &st) != 0 || !read_trailer(fd, true, footer, FOOTER_SIZE, st.st_size) ||
+        memcmp(footer + 16, TABLE_MAGIC, 8) != 0) {
+        corrupt_archive();
+    }
+    memcpy(&archive->count, footer, 8);
+    memcpy(&table, footer + 8, 8);
+    uint64_t table_end = st.st_size - FOOTER_SIZE;
+    if (table < 5 || table > table_end || archive->count > (table_end - table) / MEMBER_SIZE) {
+        corrupt_archive();
+    }
+
+    uint64_t table_size = table_end - table;
+    archive->table = malloc(table_size + 1);
+    archive->members = malloc(archive->count * sizeof(Member) + 1);
+    if (archive->table == NULL || archive->members == NULL) {
+        fprintf(stderr, "my-unzip: out of memory\n");
+        exit(1);
+    }
+    if (!read_at(fd, archive->table, table_size, table)) {
+        corrupt_archive();
+    }
+
+    uint64_t pos = 0;
+    for (uint64_t i = 0; i < archive->count; i++) {
+        Member *member = &archive->members[i];
+        if (table_size - pos < MEMBER_SIZE) {
+            corrupt_archive();
+        }
+        memcpy(&member->offset, archive->table + pos, 8);
+        memcpy(&member->compressed, archive->table + pos + 8, 8);
+        memcpy(&member->size, archive->table + pos + 16, 8);
+        memcpy(&member->name_length, archive->table + pos + 24, 4);
+        pos += MEMBER_SIZE;
+        if (member->name_length > table_size - pos || member->offset < 5 || member->offset > table ||
+            member->compressed > table - member->offset) {
+            corrupt_archive();
+        }
+        member->name = archive->table + pos;
+        pos += member->name_length;
+    }
+}
+
+// Finds a member by name, the first one if the name was stored more than once
+const Member *archive_find(const Archive *archive, const char *name) {
+    size_t len = strlen(name);
+
+    for (uint64_t i = 0; i < archive->count; i++) {
+        const Member *member = &archive->members[i];
+        if (member->name_length == len && memcmp(member->name, name, len) == 0) {
+            return member;
+        }
+    }
+    return NULL;
+}
+
+// Decodes one member, only its own records are read
+void unzip_member(int fd, const Member *member, Reader *reader, Writer *writer) {
+    writer->limited = true;
+    writer->skip = 0;
+    writer->remaining = member->size;
+    unzip_from(fd, true, member->offset, reader, writer);
+    writer->limited = false;
+}
+
+// Writes len bytes of the uncompressed data from start
+// With a block index decoding starts at the last block at or before start, without one at the beginning
+void unzip_range(const char *path, uint64_t start, uint64_t len, Reader *reader, Writer *writer) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("my-unzip: cannot open file\n");
+        exit(1);
+    }
+    bool compact = is_compact(fd);
+    uint64_t offset = compact ? 5 : 0;
+    uint64_t position = 0;
+
+    BlockIndex index;
+    if (read_index(fd, compact, &index)) {
+        // Last entry at or before start
+        uint64_t low = 0, high = index.count;
+        while (low < high) {
+            uint64_t mid = low + (high - low) / 2;
+            if (index.entries[mid].uncompressed <= start) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low > 0) {
+            offset = index.entries[low - 1].compressed;
+            position = index.entries[low - 1].uncompressed;
+        }
+        free(index.entries);
+    }
+
+    writer->limited = true;
+    writer->skip = start - position;
+    writer->remaining = len;
+    if (len > 0) {
+        unzip_from(fd, compact, offset, reader, writer);
+    }
+    close(fd);
+}
+
+// Decodes one block in memory, the compressed bytes are read with pread so workers share the file
+void decode_block(Pool *pool, Task *task) {
+    Reader reader = { .fd = -1, .start = 0, .end = task->compressed_size };
+    Writer writer = { .fd = -1, .capacity = task->uncompressed_size, .limited = true,
+                      .remaining = task->uncompressed_size };
+
+    reader.data = malloc(task->compressed_size + 1);
+    writer.data = malloc(task->uncompressed_size + 1);
+    if (reader.data == NULL || writer.data == NULL ||
+        !read_at(pool->fd, reader.data, task->compressed_size, task->compressed)) {
+        free(reader.data);
+        free(writer.data);
+        task->error = 1;
+        return;
+    }
+    if (pool->compact) {
+        unzip_compact(&reader, &writer);
+    } else {
+        unzip_legacy(&reader, &writer);
+    }
+    free(reader.data);
+
+    if (writer.length != task->uncompressed_size) {
+        free(writer.data);
+        task->error = 1;
+        return;
+    }
+    task->output = writer.data;
+}
+
+// Worker thread for -j, decodes blocks in order
+void *pool_worker(void *arg) {
+    Pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->next == pool->tail && !pool->finished) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (pool->next == pool->tail) {
+            break;
+        }
+        Task *task = &pool->tasks[pool->next % pool->capacity];
+        pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!task->direct) {
+            decode_block(pool, task);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        task->done = true;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Writes the oldest block once it is decoded
+void pool_write_oldest(Pool *pool, Reader *reader, Writer *writer) {
+    pthread_mutex_lock(&pool->lock);
+    Task *task = &pool->tasks[pool->head % pool->capacity];
+    while (!task->done) {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (task->error) {
+        fprintf(stderr, "my-unzip: corrupt block index\n");
+        exit(1);
+    }
+    if (task->direct) {
+        // A block of long runs, decoded to stdout here so vmsplice still applies
+        writer->limited = true;
+        writer->skip = 0;
+        writer->remaining = task->uncompressed_size;
+        unzip_from(pool->fd, pool->compact, task->compressed, reader, writer);
+        writer->limited = false;
+    } else {
+        writer_flush(writer);
+        if (write_all(writer->fd, task->output, task->uncompressed_size) != 0) {
+            fprintf(stderr, "my-unzip: write failed\n");
+            exit(1);
+        }
+        free(task->output);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->head++;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Decodes an indexed file with a pool of workers, one block per task, written in order
+void unzip_parallel(int fd, bool compact, const BlockIndex *index, int workers, Reader *reader, Writer *writer) {
+    Pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.fd = fd;
+    pool.compact = compact;
+    pool.capacity = (size_t) workers * TASKS_PER_WORKER;
+    pool.tasks = malloc(pool.capacity * sizeof(Task));
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    if (pool.tasks == NULL || threads == NULL) {
+        fprintf(stderr, "my-unzip: out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+
+    int started = 0;
+    for (int t = 0; t < workers; t++) {
+        if (pthread_create(&threads[started], NULL, pool_worker, &pool) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "my-unzip: cannot start worker threads\n");
+        exit(1);
+    }
+
+    for (uint64_t i = 0; i < index->count; i++) {
+        const IndexEntry *entry = &index->entries[i];
+        uint64_t next_uncompressed = (i + 1 < index->count) ? entry[1].uncompressed : index->total;
+        uint64_t next_compressed = (i + 1 < index->count) ? entry[1].compressed : index->end;
+
+        while (pool.tail - pool.head == pool.capacity) {
+            pool_write_oldest(&pool, reader, writer);
+        }
+        Task *task = &pool.tasks[pool.tail % pool.capacity];
+        memset(task, 0, sizeof(Task));
+        task->compressed = entry->compressed;
+        task->compressed_size = next_compressed - entry->compressed;
+        task->uncompressed_size = next_uncompressed - entry->uncompressed;
+        task->direct = task->uncompressed_size > MAX_BLOCK_SIZE;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.tail++;
+        pthread_cond_broadcast(&pool.changed);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.finished = true;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+
+    while (pool.head != pool.tail) {
+        pool_write_oldest(&pool, reader, writer);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    free(pool.tasks);
+}
+
+void usage(void) {
+    printf("my-unzip: [-j N] file1 [file2 ...]\n");
+    printf("my-unzip: --range start:len file\n");
+    printf("my-unzip: -t archive\n");
+    printf("my-unzip: -x name archive\n");
+    exit(1);
+}
+
+// Matches an option letter alone, with the number in the next argument, or with the digits attached (-j4)
+// A file name that only starts with the letter, like -jobs.rle, is not the option
+bool is_number_option(const char *arg, char letter) {
+    if (arg[0] != '-' || arg[1] != letter) {
+        return false;
+    }
+    for (const char *c = arg + 2; *c != '\0'; c++) {
+        if (*c < '0' || *c > '9') {
+            return false;
+        }
+    }
+    return true;
+}
 
 int main(int argc, char *argv[]) {
+    int workers = 1;
+    int arg = 1;
+    const char *range = NULL;
+    const char *extract = NULL;
+    bool list = false;
+
+    while (arg < argc) {
+        if (is_number_option(argv[arg], 'j')) {
+            const char *value = argv[arg][2] ? argv[arg] + 2 : (arg + 1 < argc ? argv[++arg] : "");
+            char *end = NULL;
+            long n = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || n < 1 || n > 1024) {
+                usage();
+            }
+            workers = n;
+            arg++;
+        } else if (strcmp(argv[arg], "--range") == 0 && arg + 1 < argc) {
+            range = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "-x") == 0 && arg + 1 < argc) {
+            extract = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "-t") == 0) {
+            list = true;
+            arg++;
+        } else {
+            break;
+        }
+    }
+
     // If no files, exit
-    if (argc < 2) {
-        printf("my-unzip: file1 [file2 ...]\n");
-        return 1;
+    if (arg >= argc || ((range != NULL || extract != NULL || list) && arg + 1 != argc)) {
+        usage();
     }
 
-    // Process each file given in the command line arguments.
-    for (int i = 1; i < argc; i++) {
+    Reader reader = {0};
+    Writer writer = { .fd = STDOUT_FILENO, .capacity = OUTPUT_SIZE };
+    reader.data = malloc(READ_SIZE);
+    writer.data = malloc(OUTPUT_SIZE);
+    if (reader.data == NULL || writer.data == NULL) {
+        fprintf(stderr, "my-unzip: out of memory\n");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        writer.pipe = true;
+        // Best effort, a smaller pipe only means more vmsplice calls
+        fcntl(STDOUT_FILENO, F_SETPIPE_SZ, PIPE_SIZE);
+    }
 
-        FILE *file;
-        
-        file = fopen(argv[i], "rb");
-        if (file == NULL) {
-            printf("my-zip: cannot open file\n");
+    if (range != NULL) {
+        char *end = NULL;
+        unsigned long long start = strtoull(range, &end, 10);
+        if (end == range || *end != ':') {
+            usage();
+        }
+        const char *len_text = end + 1;
+        unsigned long long len = strtoull(len_text, &end, 10);
+        if (end == len_text || *end != '\0') {
+            usage();
+        }
+        unzip_range(argv[arg], start, len, &reader, &writer);
+        writer_flush(&writer);
+        return 0;
+    }
+
+    if (extract != NULL || list) {
+        int fd = open(argv[arg], O_RDONLY);
+        if (fd == -1) {
+            printf("my-unzip: cannot open file\n");
+            exit(1);
+        }
+        if (!is_archive(fd)) {
+            fprintf(stderr, "my-unzip: not an archive\n");
             exit(1);
         }
+        Archive archive;
+        read_archive(fd, &archive);
+        if (list) {
+            for (uint64_t i = 0; i < archive.count; i++) {
+                printf("%12llu  %.*s\n", (unsigned long long) archive.members[i].size,
+                       (int) archive.members[i].name_length, archive.members[i].name);
+            }
+        } else {
+            const Member *member = archive_find(&archive, extract);
+            if (member == NULL) {
+                fprintf(stderr, "my-unzip: member not found\n");
+                exit(1);
+            }
+            unzip_member(fd, member, &reader, &writer);
+            writer_flush(&writer);
+        }
+        free(archive.table);
+        free(archive.members);
+        close(fd);
+        return 0;
+    }
 
-        int count;
-        char character;
+    // Process each file given in the command line arguments.
+    for (int i = arg; i < argc; i++) {
+        reader.fd = open(argv[i], O_RDONLY);
+        if (reader.fd == -1) {
+            writer_flush(&writer);
+            printf("my-unzip: cannot open file\n");
+            exit(1);
+        }
+        reader.start = 0;
+        reader.end = 0;
 
-        // Read the compressed file, 4 bytes length, 1 byte character
-        while (fread(&count, sizeof(int), 1, file) == 1 && fread(&character, sizeof(char), 1, file) == 1) {
-            // Print the character
-            for (int j = 0; j < count; j++) {
-                printf("%c", character);
+        // An archive is decoded member by member, giving the files one after another
+        if (is_archive(reader.fd)) {
+            Archive archive;
+            read_archive(reader.fd, &archive);
+            for (uint64_t m = 0; m < archive.count; m++) {
+                unzip_member(reader.fd, &archive.members[m], &reader, &writer);
             }
+            free(archive.table);
+            free(archive.members);
+            close(reader.fd);
+            continue;
+        }
+
+        // With -j an indexed file is decoded block by block
+        BlockIndex index;
+        bool compact = is_compact(reader.fd);
+        if (workers > 1 && read_index(reader.fd, compact, &index)) {
+            unzip_parallel(reader.fd, compact, &index, workers, &reader, &writer);
+            free(index.entries);
+            close(reader.fd);
+            continue;
+        }
+
+        // The compact format starts with its magic, the legacy format with its first record, which has the same size
+        if (reader_fill(&reader, 5) && memcmp(reader.data, COMPACT_MAGIC, 4) == 0 &&
+            reader.data[4] == COMPACT_VERSION) {
+            reader.start = 5;
+            unzip_compact(&reader, &writer);
+        } else {
+            unzip_legacy(&reader, &writer);
         }
 
-        fclose(file);
-        
+        close(reader.fd);
     }
 
+    writer_flush(&writer);
+    // The spliced regions are not freed, the pipe may still refer to their pages until the reader catches up
+    free(reader.data);
+    free(writer.data);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,55 +1,979 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdbool.h> 
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
-int main(int argc, char *argv[]) {
-    // If no files, exit
-    if (argc < 2) {
-        printf("my-zip: file1 [file2 ...]\n");
-        return 1;
-    }
-
-    FILE *file;
-    bool first_char = true;
-    char prev = '\0';
-    char current = '\0';
-    size_t count = 0;
-
-    for (int i = 1; i < argc; i++) {
-        
-        file = fopen(argv[i], "r");
-        if (file == NULL) {
-            printf("my-zip: cannot open file\n");
+// Input is read in blocks of this size
+#define READ_SIZE (1024 * 1024)
+// Records are collected into a buffer of this size and written in one go
+#define OUTPUT_SIZE (1024 * 1024)
+// A record is a 4-byte int count followed by the character
+#define RECORD_SIZE (sizeof(int) + 1)
+// Compact format (-c): magic and version, then varint records
+// A record value v with the low bit set is a run of v >> 1 copies of the byte that follows,
+// with the low bit clear a literal of v >> 1 bytes that follow, and v = 0 ends the records
+#define COMPACT_MAGIC "\x89RLZ"
+#define COMPACT_VERSION 1
+// Shorter runs cost less as part of a literal
+#define MIN_RUN 3
+// Literal bytes are collected up to this size before their record is written
+#define LITERAL_SIZE (64 * 1024)
+// Block index (-i): entries of uncompressed and compressed offset, then a footer with the entry count,
+// the uncompressed size and this magic as the last bytes of the file
+// In the compact format the index follows the zero that ends the records, in the legacy format its bytes
+// are carried in records with a count of zero, which decoders that do not know about the index skip
+#define INDEX_MAGIC "RLZINDEX"
+// Archive (-a): magic and version, then the compact records of each file, each ending with its own zero,
+// then a member table of offset, compressed size, size, name length and name per file, and a footer with
+// the member count, the table offset and this magic as the last bytes of the file
+#define ARCHIVE_MAGIC "\x89RLA"
+#define ARCHIVE_VERSION 1
+#define TABLE_MAGIC "RLAFILES"
+// Regular files are split into chunks of this size for -j, and mapped files are encoded and released in steps of it
+#define CHUNK_SIZE (4 * 1024 * 1024)
+// Chunks queued or waiting to be written per worker with -j
+#define TASKS_PER_WORKER 4
+
+// Where decoding can start: the first record at or after each block boundary of the uncompressed data
+typedef struct {
+    uint64_t uncompressed;
+    uint64_t compressed;
+} IndexEntry;
+
+// Run state and output buffer, the run being counted is only written when a different byte ends it
+// so runs continue across read blocks and files
+typedef struct {
+    int fd;                 // Where a full buffer is written, -1 to grow the buffer instead
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool pending;           // A run has been started
+    unsigned char byte;
+    uint64_t count;
+    bool hold_first;        // Keep the first finished run out of the buffer, it may continue a run of the chunk before
+    bool held;              // first_byte and first_count hold that run
+    unsigned char first_byte;
+    uint64_t first_count;
+    bool compact;           // Write the compact format
+    unsigned char *literal; // Bytes of the literal record being collected, compact format only
+    size_t literal_length;
+    bool hold_literal;      // Keep the short runs before the first long one as raw bytes at the start of the buffer,
+                            // they belong to the literal still open from the chunk before
+    size_t lead_length;     // Raw bytes at the start of the buffer, the held short runs
+    size_t tail_length;     // Raw bytes at the end of the buffer, the literal still open at the end of the chunk
+    uint64_t written;       // Bytes written before the buffer, the buffer starts at this output offset
+    uint64_t block_size;    // Uncompressed bytes between index entries, 0 without an index
+    uint64_t next_block;    // The next record starting at or after this offset gets an entry
+    uint64_t in_offset;     // Uncompressed bytes in the records so far
+    IndexEntry *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+} Encoder;
+
+// One file of an archive
+typedef struct {
+    const char *name;
+    uint64_t offset;        // First record of the file
+    uint64_t compressed;    // Size of its records, up to and including the zero that ends them
+    uint64_t size;          // Uncompressed size
+} Member;
+
+// Finds the runs in a block and writes the finished ones
+typedef void (*EncodeFunction)(Encoder *encoder, const unsigned char *data, size_t len);
+
+// A chunk of input for the -j worker pool, a range of a regular file or a whole unseekable file
+typedef struct {
+    int fd;
+    off_t offset;
+    size_t size;
+    bool stream;            // Read fd to its end instead of the range
+    bool last;              // Last chunk of its file, the file is closed once it is written
+    Member *member;         // Archive member the chunk belongs to, NULL outside an archive
+    bool first;             // First chunk of its file, the member starts where it is written
+    bool done;
+    int error;
+    Encoder result;         // Runs of the chunk, the first and the last one held back for the seam
+} Task;
+
+// Ring of chunks in input order, workers encode them in order and the main thread joins them in order
+typedef struct {
+    EncodeFunction encode;
+    bool compact;
+    Task *tasks;
+    size_t capacity;
+    size_t head;            // Oldest chunk not yet written
+    size_t next;            // Next chunk for a worker
+    size_t tail;            // Next free slot
+    bool finished;          // No more chunks will be added
+    pthread_t *threads;
+    int started;            // Worker threads running
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Pool;
+
+// Writes the whole buffer, retrying short writes
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void encoder_flush(Encoder *encoder) {
+    if (write_all(encoder->fd, encoder->data, encoder->length) != 0) {
+        fprintf(stderr, "my-zip: write failed\n");
+        exit(1);
+    }
+    encoder->written += encoder->length;
+    encoder->length = 0;
+}
+
+// Notes a record starting at output offset compressed that decodes to span bytes, adding an index entry
+// if it is the first record of a block
+void encoder_mark_at(Encoder *encoder, uint64_t compressed, uint64_t span) {
+    if (encoder->block_size != 0 && encoder->in_offset >= encoder->next_block) {
+        if (encoder->entry_count == encoder->entry_capacity) {
+            encoder->entry_capacity = encoder->entry_capacity ? encoder->entry_capacity * 2 : 256;
+            IndexEntry *temp = realloc(encoder->entries, encoder->entry_capacity * sizeof(IndexEntry));
+            if (temp == NULL) {
+                fprintf(stderr, "my-zip: out of memory\n");
+                exit(1);
+            }
+            encoder->entries = temp;
+        }
+        encoder->entries[encoder->entry_count].uncompressed = encoder->in_offset;
+        encoder->entries[encoder->entry_count].compressed = compressed;
+        encoder->entry_count++;
+        encoder->next_block = (encoder->in_offset / encoder->block_size + 1) * encoder->block_size;
+    }
+    encoder->in_offset += span;
+}
+
+// Notes a record about to be appended to the buffer
+static inline void encoder_mark(Encoder *encoder, uint64_t span) {
+    encoder_mark_at(encoder, encoder->written + encoder->length, span);
+}
+
+// Notes every record of an encoded chunk that is about to be written at output offset base
+void encoder_mark_records(Encoder *encoder, const char *data, size_t len, uint64_t base) {
+    size_t pos = 0;
+
+    while (pos < len) {
+        if (!encoder->compact) {
+            int count;
+            memcpy(&count, data + pos, sizeof(int));
+            encoder_mark_at(encoder, base + pos, count);
+            pos += RECORD_SIZE;
+            continue;
+        }
+
+        uint64_t value = 0;
+        size_t start = pos;
+        int shift = 0;
+        unsigned char c;
+        do {
+            c = data[pos++];
+            value |= (uint64_t) (c & 0x7f) << shift;
+            shift += 7;
+        } while (c & 0x80);
+        encoder_mark_at(encoder, base + start, value >> 1);
+        pos += (value & 1) ? 1 : value >> 1;
+    }
+}
+
+// Makes room for len more bytes, by writing the buffer out or by growing it
+void encoder_reserve(Encoder *encoder, size_t len) {
+    if (encoder->length + len <= encoder->capacity) {
+        return;
+    }
+    if (encoder->fd != -1) {
+        encoder_flush(encoder);
+        return;
+    }
+    size_t capacity = encoder->capacity ? encoder->capacity * 2 : 64 * 1024;
+    while (capacity < encoder->length + len) {
+        capacity *= 2;
+    }
+    char *temp = realloc(encoder->data, capacity);
+    if (temp == NULL) {
+        fprintf(stderr, "my-zip: out of memory\n");
+        exit(1);
+    }
+    encoder->data = temp;
+    encoder->capacity = capacity;
+}
+
+// Appends an LEB128 varint, 7 bits per byte, low bits first
+void encoder_put_varint(Encoder *encoder, uint64_t value) {
+    encoder_reserve(encoder, 10);
+    while (value >= 0x80) {
+        encoder->data[encoder->length++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    encoder->data[encoder->length++] = (char) value;
+}
+
+// Writes the literal record collected so far
+void encoder_flush_literal(Encoder *encoder) {
+    if (encoder->literal_length == 0) {
+        return;
+    }
+    encoder_mark(encoder, encoder->literal_length);
+    encoder_put_varint(encoder, (uint64_t) encoder->literal_length << 1);
+    encoder_reserve(encoder, encoder->literal_length);
+    memcpy(encoder->data + encoder->length, encoder->literal, encoder->literal_length);
+    encoder->length += encoder->literal_length;
+    encoder->literal_length = 0;
+}
+
+// Adds bytes to the literal being collected, writing its record each time it is full
+void encoder_add_literal(Encoder *encoder, const unsigned char *bytes, size_t len) {
+    while (len > 0) {
+        if (encoder->literal_length == LITERAL_SIZE) {
+            encoder_flush_literal(encoder);
+        }
+        size_t part = LITERAL_SIZE - encoder->literal_length;
+        if (part > len) {
+            part = len;
+        }
+        memcpy(encoder->literal + encoder->literal_length, bytes, part);
+        encoder->literal_length += part;
+        bytes += part;
+        len -= part;
+    }
+}
+
+// Writes one run
+// In the legacy format a count does not fit in the int of a record past INT_MAX, so longer runs take several records
+// In the compact format short runs go into a literal record instead
+void encoder_emit(Encoder *encoder, unsigned char byte, uint64_t count) {
+    if (encoder->hold_first) {
+        encoder->hold_first = false;
+        encoder->held = true;
+        encoder->first_byte = byte;
+        encoder->first_count = count;
+        return;
+    }
+
+    if (encoder->compact) {
+        if (count >= MIN_RUN) {
+            if (encoder->hold_literal) {
+                encoder->hold_literal = false;
+                encoder->lead_length = encoder->length;
+            }
+            encoder_flush_literal(encoder);
+            encoder_mark(encoder, count);
+            encoder_put_varint(encoder, count << 1 | 1);
+            encoder_reserve(encoder, 1);
+            encoder->data[encoder->length++] = byte;
+            return;
+        }
+        if (encoder->hold_literal) {
+            encoder_reserve(encoder, count);
+            memset(encoder->data + encoder->length, byte, count);
+            encoder->length += count;
+            return;
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            if (encoder->literal_length == LITERAL_SIZE) {
+                encoder_flush_literal(encoder);
+            }
+            encoder->literal[encoder->literal_length++] = byte;
+        }
+        return;
+    }
+
+    while (count > 0) {
+        int part = (count > INT_MAX) ? INT_MAX : (int) count;
+        encoder_reserve(encoder, RECORD_SIZE);
+        encoder_mark(encoder, part);
+        memcpy(encoder->data + encoder->length, &part, sizeof(int));
+        encoder->data[encoder->length + sizeof(int)] = byte;
+        encoder->length += RECORD_SIZE;
+        count -= part;
+    }
+}
+
+// Ends the current run at a byte that differs from it and starts a new run with that byte
+static inline void encoder_switch(Encoder *encoder, unsigned char byte, uint64_t count) {
+    encoder_emit(encoder, encoder->byte, encoder->count + count);
+    encoder->byte = byte;
+    encoder->count = 0;
+}
+
+// Plain byte loop, used where no vector unit is available
+void encode_scalar(Encoder *encoder, const unsigned char *data, size_t len) {
+    size_t start = 0;   // First byte of the current run inside this block
+
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != encoder->byte) {
+            encoder_switch(encoder, data[i], i - start);
+            start = i;
+        }
+    }
+    encoder->count += len - start;
+}
+
+#ifdef HAVE_X86_SIMD
+// Compares 16 bytes with the bytes one position earlier, every set bit of the mask is a run boundary
+// Long runs are skipped 16 bytes per step, and on data without runs all boundaries of a step come from one mask
+__attribute__((target("sse2")))
+void encode_sse2(Encoder *encoder, const unsigned char *data, size_t len) {
+    size_t start = 0;
+    size_t i = 0;
+
+    // The first byte is compared with the run carried over from before
+    if (len > 0 && data[0] != encoder->byte) {
+        encoder_switch(encoder, data[0], 0);
+    }
+    for (i = 1; i + 16 <= len; i += 16) {
+        __m128i current = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i previous = _mm_loadu_si128((const __m128i *) (data + i - 1));
+        unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(current, previous)) & 0xffff;
+
+        while (mask != 0) {
+            size_t boundary = i + __builtin_ctz(mask);
+            encoder_switch(encoder, data[boundary], boundary - start);
+            start = boundary;
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; i++) {
+        if (data[i] != data[i - 1]) {
+            encoder_switch(encoder, data[i], i - start);
+            start = i;
+        }
+    }
+    encoder->count += len - start;
+}
+
+// Same as encode_sse2 with 32 bytes per step
+__attribute__((target("avx2")))
+void encode_avx2(Encoder *encoder, const unsigned char *data, size_t len) {
+    size_t start = 0;
+    size_t i = 0;
+
+    if (len > 0 && data[0] != encoder->byte) {
+        encoder_switch(encoder, data[0], 0);
+    }
+    for (i = 1; i + 32 <= len; i += 32) {
+        __m256i current = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i previous = _mm256_loadu_si256((const __m256i *) (data + i - 1));
+        uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(current, previous));
+
+        while (mask != 0) {
+            size_t boundary = i + __builtin_ctz(mask);
+            encoder_switch(encoder, data[boundary], boundary - start);
+            start = boundary;
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; i++) {
+        if (data[i] != data[i - 1]) {
+            encoder_switch(encoder, data[i], i - start);
+            start = i;
+        }
+    }
+    encoder->count += len - start;
+}
+#endif
+
+// Starts a run with the first byte of all input, or of a chunk
+void encoder_start(Encoder *encoder, unsigned char byte) {
+    if (!encoder->pending) {
+        encoder->byte = byte;
+        encoder->count = 0;
+        encoder->pending = true;
+    }
+}
+
+// Adds a run that follows the current one, extending it if the byte is the same
+void encoder_merge(Encoder *encoder, unsigned char byte, uint64_t count) {
+    if (encoder->pending && encoder->byte == byte) {
+        encoder->count += count;
+        return;
+    }
+    if (encoder->pending) {
+        encoder_emit(encoder, encoder->byte, encoder->count);
+    }
+    encoder->byte = byte;
+    encoder->count = count;
+    encoder->pending = true;
+}
+
+// Encodes one chunk into its own buffer, with the first and last runs held back
+// In the compact format the literals at both ends are held back as well, as raw bytes around the records
+void encode_task(Pool *pool, Task *task, unsigned char *buffer, unsigned char *literal) {
+    Encoder *result = &task->result;
+    memset(result, 0, sizeof(Encoder));
+    result->fd = -1;
+    result->hold_first = true;
+    result->compact = pool->compact;
+    result->literal = literal;
+    result->hold_literal = pool->compact;
+
+    size_t done = 0;
+    while (task->stream || done < task->size) {
+        size_t want = READ_SIZE;
+        if (!task->stream && task->size - done < want) {
+            want = task->size - done;
+        }
+        ssize_t n = task->stream ? read(task->fd, buffer, want) : pread(task->fd, buffer, want, task->offset + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            task->error = 1;
+            return;
+        }
+        if (n == 0) {
+            // A file that shrank ends its last chunk early
+            break;
+        }
+        encoder_start(result, buffer[0]);
+        pool->encode(result, buffer, n);
+        done += n;
+    }
+    task->size = done;
+    if (result->hold_literal) {
+        result->hold_literal = false;
+        result->lead_length = result->length;
+    }
+    // The literal buffer belongs to the worker, so the open literal is kept after the records
+    result->tail_length = result->literal_length;
+    if (result->literal_length > 0) {
+        encoder_reserve(result, result->literal_length);
+        memcpy(result->data + result->length, result->literal, result->literal_length);
+        result->length += result->literal_length;
+        result->literal_length = 0;
+    }
+}
+
+// Joins a chunk to the output in order
+// The seam: the chunk's first run continues the run still open from before if it has the same byte,
+// and in the compact format its leading short runs continue the literal still open from before
+void write_task(Encoder *out, Task *task) {
+    Encoder *result = &task->result;
+
+    if (!result->pending) {
+        return;
+    }
+    if (result->held) {
+        encoder_merge(out, result->first_byte, result->first_count);
+        // The first run ended inside the chunk, so the open run is finished
+        encoder_emit(out, out->byte, out->count);
+        out->pending = false;
+        encoder_add_literal(out, (unsigned char *) result->data, result->lead_length);
+
+        // Runs in the middle are complete and were encoded exactly as the sequential encoder would
+        const char *records = result->data + result->lead_length;
+        size_t length = result->length - result->lead_length - result->tail_length;
+        if (length > 0) {
+            // They start with a long run, which ends the open literal
+            encoder_flush_literal(out);
+            if (out->block_size != 0) {
+                encoder_mark_records(out, records, length, out->written + out->length);
+            }
+        }
+        if (length > OUTPUT_SIZE) {
+            encoder_flush(out);
+            if (write_all(out->fd, records, length) != 0) {
+                fprintf(stderr, "my-zip: write failed\n");
+                exit(1);
+            }
+            out->written += length;
+        } else if (length > 0) {
+            encoder_reserve(out, length);
+            memcpy(out->data + out->length, records, length);
+            out->length += length;
+        }
+
+        // The literal open at the end of the chunk may go on in the next chunk
+        encoder_add_literal(out, (unsigned char *) result->data + result->length - result->tail_length, result->tail_length);
+    }
+    // The last run may go on in the next chunk
+    encoder_merge(out, result->byte, result->count);
+}
+
+// Worker thread for -j, encodes chunks in order
+void *pool_worker(void *arg) {
+    Pool *pool = arg;
+    unsigned char *buffer = malloc(READ_SIZE);
+    unsigned char *literal = malloc(LITERAL_SIZE);
+    if (buffer == NULL || literal == NULL) {
+        fprintf(stderr, "my-zip: out of memory\n");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->next == pool->tail && !pool->finished) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (pool->next == pool->tail) {
+            break;
+        }
+        Task *task = &pool->tasks[pool->next % pool->capacity];
+        pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        encode_task(pool, task, buffer, literal);
+
+        pthread_mutex_lock(&pool->lock);
+        task->done = true;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(buffer);
+    free(literal);
+    return NULL;
+}
+
+// Ends the records of an archive member with the open run and a zero, so no run continues into the next file
+void encoder_end_member(Encoder *encoder, Member *member) {
+    if (encoder->pending) {
+        encoder_emit(encoder, encoder->byte, encoder->count);
+        encoder->pending = false;
+    }
+    encoder_flush_literal(encoder);
+    encoder_put_varint(encoder, 0);
+    member->compressed = encoder->written + encoder->length - member->offset;
+}
+
+// Waits for the oldest chunk and joins it to the output
+void pool_write_oldest(Pool *pool, Encoder *out) {
+    pthread_mutex_lock(&pool->lock);
+    Task *task = &pool->tasks[pool->head % pool->capacity];
+    while (!task->done) {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (task->error) {
+        fprintf(stderr, "my-zip: read failed\n");
+        exit(1);
+    }
+    if (task->member != NULL && task->first) {
+        task->member->offset = out->written + out->length;
+    }
+    write_task(out, task);
+    if (task->member != NULL) {
+        task->member->size += task->size;
+        if (task->last) {
+            encoder_end_member(out, task->member);
+        }
+    }
+    free(task->result.data);
+    if (task->last) {
+        close(task->fd);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->head++;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Queues a chunk, first writing finished chunks while the ring is full
+void pool_add(Pool *pool, Encoder *out, int fd, off_t offset, size_t size, bool stream, bool last, Member *member) {
+    while (pool->tail - pool->head == pool->capacity) {
+        pool_write_oldest(pool, out);
+    }
+    Task *task = &pool->tasks[pool->tail % pool->capacity];
+    memset(task, 0, sizeof(Task));
+    task->fd = fd;
+    task->offset = offset;
+    task->size = size;
+    task->stream = stream;
+    task->last = last;
+    task->member = member;
+    task->first = (offset == 0);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->tail++;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Starts the worker threads of a pool that takes chunks until pool_finish
+void pool_start(Pool *pool, EncodeFunction encode, bool compact, int workers) {
+    memset(pool, 0, sizeof(Pool));
+    pool->encode = encode;
+    pool->compact = compact;
+    pool->capacity = (size_t) workers * TASKS_PER_WORKER;
+    pool->tasks = malloc(pool->capacity * sizeof(Task));
+    pool->threads = malloc(workers * sizeof(pthread_t));
+    if (pool->tasks == NULL || pool->threads == NULL) {
+        fprintf(stderr, "my-zip: out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+
+    for (int t = 0; t < workers; t++) {
+        if (pthread_create(&pool->threads[pool->started], NULL, pool_worker, pool) == 0) {
+            pool->started++;
+        }
+    }
+    if (pool->started == 0) {
+        fprintf(stderr, "my-zip: cannot start worker threads\n");
+        exit(1);
+    }
+}
+
+// Queues the chunks of one file, regular files are split, anything else is one task read to its end
+// In an archive every file is a task even when empty, its last task ends the member
+void pool_add_file(Pool *pool, Encoder *out, const char *path, Member *member) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        // Everything before the file is written first, as in a sequential run
+        while (pool->head != pool->tail) {
+            pool_write_oldest(pool, out);
+        }
+        encoder_flush(out);
+        printf("my-zip: cannot open file\n");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        pool_add(pool, out, fd, 0, 0, true, true, member);
+        return;
+    }
+    if (st.st_size == 0) {
+        if (member != NULL) {
+            pool_add(pool, out, fd, 0, 0, false, true, member);
+        } else {
+            close(fd);
+        }
+        return;
+    }
+    for (off_t offset = 0; offset < st.st_size; offset += CHUNK_SIZE) {
+        size_t size = (st.st_size - offset < CHUNK_SIZE) ? (size_t) (st.st_size - offset) : CHUNK_SIZE;
+        pool_add(pool, out, fd, offset, size, false, offset + CHUNK_SIZE >= st.st_size, member);
+    }
+}
+
+// Writes the chunks still queued and stops the workers
+void pool_finish(Pool *pool, Encoder *out) {
+    pthread_mutex_lock(&pool->lock);
+    pool->finished = true;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+
+    while (pool->head != pool->tail) {
+        pool_write_oldest(pool, out);
+    }
+    for (int t = 0; t < pool->started; t++) {
+        pthread_join(pool->threads[t], NULL);
+    }
+    free(pool->threads);
+    free(pool->tasks);
+}
+
+// Compresses the files with a pool of workers, the output is byte for byte the one of a sequential run
+// Regular files are split into chunks encoded at the same time, the runs at the chunk seams are joined in order
+void zip_parallel(EncodeFunction encode, Encoder *out, char **files, int file_count, int workers) {
+    Pool pool;
+    pool_start(&pool, encode, out->compact, workers);
+    for (int i = 0; i < file_count; i++) {
+        pool_add_file(&pool, out, files[i], NULL);
+    }
+    pool_finish(&pool, out);
+}
+
+// Encodes a file with read, returns the number of bytes read
+uint64_t zip_read(EncodeFunction encode, Encoder *encoder, int fd, unsigned char *buffer) {
+    uint64_t total = 0;
+    ssize_t n;
+
+    while ((n = read(fd, buffer, READ_SIZE)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "my-zip: read failed\n");
             exit(1);
         }
+        // The first byte of all input starts the first run
+        encoder_start(encoder, buffer[0]);
+        encode(encoder, buffer, n);
+        total += n;
+    }
+    return total;
+}
+
+// Encodes a file through a memory map, one chunk at a time, pages already encoded are released
+// so a large file never stays resident as a whole
+// Files that cannot be mapped, like pipes, are read instead
+uint64_t zip_mapped(EncodeFunction encode, Encoder *encoder, int fd, unsigned char *buffer) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return zip_read(encode, encoder, fd, buffer);
+    }
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return zip_read(encode, encoder, fd, buffer);
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
 
-        while ((current = fgetc(file)) != EOF) {
-            if (first_char) {
-                prev = current;
-                count = 1;
-                first_char = false;
-            } else {
-                // Current character is the same as previous
-                if (current == prev) {
-                    count++;
-                } else {
-                    // Write 4-byte integer and the character.
-                    fwrite(&count, sizeof(int), 1, stdout);
-                    fwrite(&prev, sizeof(char), 1, stdout);
-                    count = 1;
-                    prev = current;
-                }
+    encoder_start(encoder, data[0]);
+    for (off_t offset = 0; offset < st.st_size; offset += CHUNK_SIZE) {
+        size_t size = (st.st_size - offset < CHUNK_SIZE) ? (size_t) (st.st_size - offset) : CHUNK_SIZE;
+        encode(encoder, data + offset, size);
+        madvise(data + offset, size, MADV_DONTNEED);
+    }
+    munmap(data, st.st_size);
+    return st.st_size;
+}
+
+// Appends trailer bytes, as they are after the compact end of records, or one per zero-count legacy record
+void encoder_put_trailer(Encoder *encoder, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    int zero = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (encoder->compact) {
+            encoder_reserve(encoder, 1);
+        } else {
+            encoder_reserve(encoder, RECORD_SIZE);
+            memcpy(encoder->data + encoder->length, &zero, sizeof(int));
+            encoder->length += sizeof(int);
+        }
+        encoder->data[encoder->length++] = bytes[i];
+    }
+}
+
+// Writes the block index after the records
+void encoder_write_index(Encoder *encoder) {
+    for (size_t i = 0; i < encoder->entry_count; i++) {
+        encoder_put_trailer(encoder, &encoder->entries[i], sizeof(IndexEntry));
+    }
+    uint64_t footer[2] = { encoder->entry_count, encoder->in_offset };
+    encoder_put_trailer(encoder, footer, sizeof(footer));
+    encoder_put_trailer(encoder, INDEX_MAGIC, 8);
+}
+
+// Writes the member table and the footer after the last file of an archive
+void encoder_write_table(Encoder *encoder, const Member *members, size_t count) {
+    uint64_t table = encoder->written + encoder->length;
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t fields[3] = { members[i].offset, members[i].compressed, members[i].size };
+        uint32_t name_length = strlen(members[i].name);
+        encoder_put_trailer(encoder, fields, sizeof(fields));
+        encoder_put_trailer(encoder, &name_length, sizeof(name_length));
+        encoder_put_trailer(encoder, members[i].name, name_length);
+    }
+    uint64_t footer[2] = { count, table };
+    encoder_put_trailer(encoder, footer, sizeof(footer));
+    encoder_put_trailer(encoder, TABLE_MAGIC, 8);
+}
+
+// Compresses every file into its own member of an archive
+// A run does not continue from one file into the next, so each member can be decoded on its own
+// With -j one pool serves the whole archive, so many small files do not start and stop threads each
+void zip_archive(EncodeFunction encode, Encoder *encoder, char **files, int file_count, int workers) {
+    Member *members = calloc(file_count, sizeof(Member));
+    unsigned char *buffer = malloc(READ_SIZE);
+    if (members == NULL || buffer == NULL) {
+        fprintf(stderr, "my-zip: out of memory\n");
+        exit(1);
+    }
+
+    if (workers > 1) {
+        Pool pool;
+        pool_start(&pool, encode, encoder->compact, workers);
+        for (int i = 0; i < file_count; i++) {
+            members[i].name = files[i];
+            pool_add_file(&pool, encoder, files[i], &members[i]);
+        }
+        pool_finish(&pool, encoder);
+    } else {
+        for (int i = 0; i < file_count; i++) {
+            members[i].name = files[i];
+            members[i].offset = encoder->written + encoder->length;
+            int fd = open(files[i], O_RDONLY);
+            if (fd == -1) {
+                encoder_flush(encoder);
+                printf("my-zip: cannot open file\n");
+                exit(1);
             }
+            members[i].size = zip_mapped(encode, encoder, fd, buffer);
+            close(fd);
+            encoder_end_member(encoder, &members[i]);
         }
+    }
+
+    encoder_write_table(encoder, members, file_count);
+    encoder_flush(encoder);
+    free(members);
+    free(buffer);
+}
+
+// Picks the widest run detector the CPU supports
+EncodeFunction pick_encoder(void) {
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return encode_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return encode_sse2;
+    }
+#endif
+    return encode_scalar;
+}
 
-        fclose(file);
+void usage(void) {
+    printf("my-zip: [-c] [-i K] [-j N] file1 [file2 ...]\n");
+    printf("my-zip: -a [-j N] file1 [file2 ...]\n");
+    exit(1);
+}
 
+// Matches an option letter alone, with the number in the next argument, or with the digits attached (-j4)
+// A file name that only starts with the letter, like -jobs.txt or -input.txt, is not the option
+bool is_number_option(const char *arg, char letter) {
+    if (arg[0] != '-' || arg[1] != letter) {
+        return false;
+    }
+    for (const char *c = arg + 2; *c != '\0'; c++) {
+        if (*c < '0' || *c > '9') {
+            return false;
+        }
     }
+    return true;
+}
 
-    if (!first_char) {
-        fwrite(&count, sizeof(int), 1, stdout);
-        fwrite(&prev, sizeof(char), 1, stdout);
+int main(int argc, char *argv[]) {
+    int workers = 1;
+    int arg = 1;
+    bool compact = false;
+    bool archive = false;
+    long block_mib = 0;
+
+    while (arg < argc) {
+        if (is_number_option(argv[arg], 'j')) {
+            const char *value = argv[arg][2] ? argv[arg] + 2 : (arg + 1 < argc ? argv[++arg] : "");
+            char *end = NULL;
+            long n = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || n < 1 || n > 1024) {
+                usage();
+            }
+            workers = n;
+            arg++;
+        } else if (is_number_option(argv[arg], 'i')) {
+            const char *value = argv[arg][2] ? argv[arg] + 2 : (arg + 1 < argc ? argv[++arg] : "");
+            char *end = NULL;
+            block_mib = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || block_mib < 1 || block_mib > 1024 * 1024) {
+                usage();
+            }
+            arg++;
+        } else if (strcmp(argv[arg], "-c") == 0) {
+            compact = true;
+            arg++;
+        } else if (strcmp(argv[arg], "-a") == 0) {
+            archive = true;
+            arg++;
+        } else {
+            break;
+        }
+    }
+
+    // If no files, exit
+    // The block index covers one stream of records, an archive has one per file
+    if (arg >= argc || (archive && block_mib != 0)) {
+        usage();
+    }
+    // Archive members are stored in the compact format
+    if (archive) {
+        compact = true;
+    }
+
+    EncodeFunction encode = pick_encoder();
+    Encoder encoder = { .fd = STDOUT_FILENO, .capacity = OUTPUT_SIZE, .compact = compact };
+    encoder.block_size = (uint64_t) block_mib * 1024 * 1024;
+    encoder.data = malloc(OUTPUT_SIZE);
+    encoder.literal = malloc(LITERAL_SIZE);
+    if (encoder.data == NULL || encoder.literal == NULL) {
+        fprintf(stderr, "my-zip: out of memory\n");
+        exit(1);
+    }
+
+    if (archive) {
+        memcpy(encoder.data, ARCHIVE_MAGIC, 4);
+        encoder.data[4] = ARCHIVE_VERSION;
+        encoder.length = 5;
+        zip_archive(encode, &encoder, argv + arg, argc - arg, workers);
+        free(encoder.data);
+        free(encoder.literal);
+        return 0;
+    }
+    if (compact) {
+        memcpy(encoder.data, COMPACT_MAGIC, 4);
+        encoder.data[4] = COMPACT_VERSION;
+        encoder.length = 5;
+    }
+
+    if (workers > 1) {
+        zip_parallel(encode, &encoder, argv + arg, argc - arg, workers);
+    } else {
+        unsigned char *buffer = malloc(READ_SIZE);
+        if (buffer == NULL) {
+            fprintf(stderr, "my-zip: out of memory\n");
+            exit(1);
+        }
+
+        for (int i = arg; i < argc; i++) {
+            int fd = open(argv[i], O_RDONLY);
+            if (fd == -1) {
+                encoder_flush(&encoder);
+                printf("my-zip: cannot open file\n");
+                exit(1);
+            }
+
+            zip_read(encode, &encoder, fd, buffer);
+            close(fd);
+        }
+        free(buffer);
+    }
+
+    // The last run has nothing after it to end it
+    if (encoder.pending) {
+        encoder_emit(&encoder, encoder.byte, encoder.count);
+    }
+    if (compact) {
+        encoder_flush_literal(&encoder);
+        encoder_put_varint(&encoder, 0);
+    }
+    if (encoder.block_size != 0) {
+        encoder_write_index(&encoder);
     }
+    encoder_flush(&encoder);
 
+    free(encoder.data);
+    free(encoder.literal);
+    free(encoder.entries);
     return 0;
-}
\ No newline at end of file
+}
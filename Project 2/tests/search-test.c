@@ -0,0 +1,132 @@
+// Randomized differential test of the my-grep single pattern searches
+// Every search function the CPU supports is compared with a naive search on random texts and patterns,
+// with matches placed on the 16 and 32 byte block edges of the vector loops and at the very end of the text
+// Build and run from Project 2:
+//   gcc -O2 -fsanitize=address -o search-test tests/search-test.c -lpthread && ./search-test [seed]
+#define main my_grep_main
+#include "../my-grep.c"
+#undef main
+
+#define ITERATIONS 200000
+#define MAX_TEXT 600
+#define MAX_PATTERN 40
+
+// Reference search, checks every position
+const char *naive_search(const char *pattern, size_t pattern_len, const char *text, size_t text_len) {
+    for (size_t i = 0; i + pattern_len <= text_len; i++) {
+        if (memcmp(text + i, pattern, pattern_len) == 0) {
+            return text + i;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    const char *name;
+    SearchFunction search;
+} Candidate;
+
+int main(int argc, char *argv[]) {
+    unsigned seed = (argc > 1) ? (unsigned) strtoul(argv[1], NULL, 10) : 1;
+    srand(seed);
+
+    Candidate candidates[4];
+    int candidate_count = 0;
+    candidates[candidate_count++] = (Candidate) { "boyer_moore_search", boyer_moore_search };
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("sse2")) {
+        candidates[candidate_count++] = (Candidate) { "sse2_search", sse2_search };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        candidates[candidate_count++] = (Candidate) { "avx2_search", avx2_search };
+    }
+#endif
+
+    char pattern[MAX_PATTERN + 1];
+    char scratch[MAX_TEXT];
+    // Small alphabets make partial matches and near misses common
+    const char *alphabets[] = { "a", "ab", "abc", "ab\nc", "abcdefghijklmnopqrstuvwxyz" };
+    const int alphabet_count = sizeof(alphabets) / sizeof(alphabets[0]);
+    const int edges[] = { 16, 32 };
+
+    for (long iteration = 0; iteration < ITERATIONS; iteration++) {
+        const char *alphabet = alphabets[rand() % alphabet_count];
+        size_t alphabet_len = strlen(alphabet);
+
+        // Lengths 1 and 2 are the special cases of the first and last byte filter
+        size_t pattern_len;
+        switch (rand() % 4) {
+            case 0: pattern_len = 1; break;
+            case 1: pattern_len = 2; break;
+            default: pattern_len = 3 + rand() % (MAX_PATTERN - 2); break;
+        }
+        for (size_t i = 0; i < pattern_len; i++) {
+            pattern[i] = alphabet[rand() % alphabet_len];
+        }
+        pattern[pattern_len] = '\0';
+
+        size_t text_len = rand() % MAX_TEXT;
+        for (size_t i = 0; i < text_len; i++) {
+            scratch[i] = alphabet[rand() % alphabet_len];
+        }
+
+        // Place the pattern where the vector loops are most likely to get it wrong
+        if (text_len >= pattern_len) {
+            size_t position;
+            switch (rand() % 4) {
+                case 0: {
+                    // Starting just before, at or after a block edge
+                    int edge = edges[rand() % 2];
+                    position = (rand() % (text_len / edge + 1)) * edge + (rand() % 3) - 1;
+                    break;
+                }
+                case 1: {
+                    // Ending just before, at or after a block edge
+                    int edge = edges[rand() % 2];
+                    position = (rand() % (text_len / edge + 1)) * edge + (rand() % 3) - 1 - (pattern_len - 1);
+                    break;
+                }
+                case 2:
+                    // At the very end of the text
+                    position = text_len - pattern_len;
+                    break;
+                default:
+                    // Not placed, random text only
+                    position = SIZE_MAX;
+                    break;
+            }
+            if (position <= text_len - pattern_len) {
+                memcpy(scratch + position, pattern, pattern_len);
+            }
+        }
+
+        // An exactly sized copy, so reading past the end is caught by the address sanitizer
+        char *text = malloc(text_len ? text_len : 1);
+        if (text == NULL) {
+            fprintf(stderr, "search-test: out of memory\n");
+            return 1;
+        }
+        memcpy(text, scratch, text_len);
+
+        Searcher searcher;
+        searcher_init(&searcher, pattern);
+        const char *expected = naive_search(pattern, pattern_len, text, text_len);
+
+        for (int c = 0; c <= candidate_count; c++) {
+            // The last round checks the function searcher_init picked for this pattern
+            const char *name = (c < candidate_count) ? candidates[c].name : "searcher->search";
+            SearchFunction search = (c < candidate_count) ? candidates[c].search : searcher.search;
+            const char *found = search(&searcher, text, text_len);
+            if (found != expected) {
+                fprintf(stderr, "search-test: %s differs, seed %u iteration %ld\n", name, seed, iteration);
+                fprintf(stderr, "  pattern length %zu, text length %zu, expected %ld, found %ld\n", pattern_len, text_len,
+                        expected ? (long) (expected - text) : -1L, found ? (long) (found - text) : -1L);
+                return 1;
+            }
+        }
+        free(text);
+    }
+
+    printf("search-test: %d cases passed for %d search functions\n", ITERATIONS, candidate_count + 1);
+    return 0;
+}
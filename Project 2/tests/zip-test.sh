@@ -0,0 +1,58 @@
+#!/bin/bash
+# Checks that my-zip -j writes exactly the bytes of a sequential run, in the legacy and the compact format,
+# with a block index and as an archive, and that my-unzip gives back the input
+# The inputs mix long runs with short ones that go into literals, across several 4 MiB chunk seams
+#
+# Usage, from Project 2:
+#   tests/zip-test.sh
+set -e
+
+cd "$(dirname "$0")/.."
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc -O2 -o "$work/my-zip" my-zip.c -lpthread
+gcc -O2 -o "$work/my-unzip" my-unzip.c -lpthread
+
+# 14 bytes without runs, a single literal that a seam must not split
+printf 'abcdefghijklmn' > "$work/tiny.txt"
+# Literals of up to 200 bytes between runs of up to 64 KiB
+awk 'BEGIN { srand(2); q = "q"; while (length(q) < 65536) q = q q; while (size < 12000000) { n = int(rand() * 200); s = ""; for (i = 0; i < n; i++) s = s sprintf("%c", 97 + int(rand() * 8)); s = s substr(q, 1, int(rand() * rand() * 65536)); printf "%s", s; size += length(s) } }' > "$work/mixed.txt"
+# Over 4 MiB without a run of 3, one literal across every seam
+awk 'BEGIN { srand(3); for (i = 0; i < 9000000; i++) printf "%c", i % 2 ? 98 + int(rand() * 25) : 97 }' > "$work/literal.txt"
+: > "$work/empty.txt"
+
+failed=0
+check() {
+    local name=$1
+    shift
+    "$work/my-zip" "$@" > "$work/sequential.out"
+    for workers in 2 4; do
+        "$work/my-zip" -j $workers "$@" > "$work/parallel.out"
+        if ! cmp -s "$work/sequential.out" "$work/parallel.out"; then
+            echo "FAIL $name: -j $workers differs from a sequential run"
+            failed=1
+        fi
+    done
+}
+
+cd "$work"
+for options in "" "-c" "-i 1" "-c -i 1" "-a"; do
+    check "${options:-legacy} tiny" $options tiny.txt
+    check "${options:-legacy} mixed" $options mixed.txt
+    check "${options:-legacy} literal" $options literal.txt
+    check "${options:-legacy} several files" $options tiny.txt mixed.txt empty.txt literal.txt tiny.txt
+done
+
+# Round trips
+for options in "" "-c"; do
+    ./my-zip -j 4 $options mixed.txt literal.txt > both.z
+    cat mixed.txt literal.txt | cmp -s - <(./my-unzip both.z) || { echo "FAIL ${options:-legacy}: round trip"; failed=1; }
+done
+./my-zip -a -j 4 tiny.txt mixed.txt empty.txt literal.txt > files.rla
+for name in tiny.txt mixed.txt empty.txt literal.txt; do
+    ./my-unzip -x $name files.rla | cmp -s - $name || { echo "FAIL -a: $name does not extract"; failed=1; }
+done
+
+[ $failed = 0 ] && echo "all passed"
+exit $failed
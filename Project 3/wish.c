@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,8 +9,9 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
+#include <spawn.h>
 
-#define MAX_PID_COUNT 100
 #define ERROR_MSG "An error has occurred\n"
 #define MEMORY_ERROR_MSG "Failed to allocate memory\n"
 #define COMMAND_ERROR_MSG "Command not found\n"
@@ -18,28 +20,75 @@
 #define PID_ERROR_MSG "Pid fail\n"
 #define REDIRECT_ERROR_MSG "Redirection fail\n"
 #define FILE_ERROR_MSG "Error writing or reading file\n"
+#define HASH_EMPTY_MSG "hash: hash table empty\n"
+#define PIPE_SIZE (1024 * 1024)  // Buffer size asked for on pipeline pipes, best effort
+#define JOB_INITIAL_SIZE 16     // Initial child slot count of the job table
+#define HASH_INITIAL_SIZE 64    // Initial slot count of the command hash table, always a power of two
 
 
-typedef struct {
+typedef struct Command {
     char *command;              // Command name
     char **args;                // Array for tokenized representation of a command
     char *output_file;          // Output file for redirection (or NULL if none)
     int redirect;               // 0 for none, 1 for output redirection
     size_t arg_count;           // Argument counter (number of tokens)
+    struct Command *next;       // Next stage of a | pipeline, NULL for the last stage
 } Command;
 
+// Child processes started by one input line, a job is one & command, all stages of a pipeline belong to the same job
+typedef struct {
+    pid_t *pids;                // Running child processes
+    size_t *jobs;               // Job of each child, the index of its & command on the line
+    size_t count;               // Number of running child processes
+    size_t capacity;            // Slots in pids and jobs
+    size_t *remaining;          // Running child processes per job
+    size_t running;             // Jobs with at least one running child process
+} JobTable;
+
+typedef struct {
+    char *name;                 // Command name as typed, NULL for an empty slot
+    char *full_path;            // Resolved executable path
+    size_t hits;                // Times the command has been run through this entry
+} HashEntry;
+
+// Command hash table, maps command names to resolved paths so the path directories are only searched once per command
+// Open addressing with linear probing, cleared whenever the search path changes
+static HashEntry *hash_table = NULL;
+static size_t hash_capacity = 0;
+static size_t hash_count = 0;
+
+// Most & commands of a line running at the same time, set with wish -j N, 0 for no limit
+static size_t max_jobs = 0;
+
+extern char **environ;
+
 bool init_struct(Command *command, char *command_name, size_t arg_count, char **args, char *output_file);
 void free_struct(Command *command);
 bool update_path(Command *command, char ***paths, size_t *path_count);
 char *resolve_path(char *command_name, char **paths, size_t path_count);
-void parse_line(char *curr_line, char **paths, size_t *path_count);
+uint64_t hash_name(const char *name);
+HashEntry *hash_slot(HashEntry *table, size_t capacity, const char *name);
+bool hash_insert(char *name, char *full_path);
+void hash_clear(void);
+void hash_print(void);
+char *find_command(char *command_name, char **paths, size_t path_count);
+void parse_line(char *curr_line, char ***paths, size_t *path_count);
 Command *parse_command(char *command);
-void execute_command(Command *command, char **paths, size_t path_count);
+Command *parse_pipeline(char *line);
+pid_t launch_command(Command *command, char *full_path, int input, int output);
+pid_t fork_built_in(Command *command, char ***paths, size_t *path_count, char *curr_line, int input, int output);
+void launch_pipeline(Command *first, char ***paths, size_t *path_count, char *curr_line, JobTable *table, size_t job);
+bool job_init(JobTable *table, size_t job_count);
+void job_free(JobTable *table);
+void job_add(JobTable *table, pid_t pid, size_t job);
+void job_reap(JobTable *table);
+bool is_built_in(Command *command);
 bool built_in_commands(Command *command, char ***paths, size_t *path_count, char *curr_line);
 char *trim(char *str);
 void parse_free(char **args, size_t args_count, char *command_dup, char *output_file);
 bool parse_error(void *pointer, char **args, size_t args_count, char *command_dup, char *output_file);
 void custom_write(int fd, const char *msg, size_t len);
+bool is_number_option(const char *arg, char letter);
 
 // Initializes a Command struct with the given parameters
 // Allocates memory for command name, argument list, and optional output file
@@ -52,6 +101,7 @@ bool init_struct(Command *command, char *command_name, size_t arg_count, char **
     }
 
     command->arg_count = arg_count;
+    command->next = NULL;
 
     command->args = malloc(sizeof(char *) * (arg_count)); // Allocate memory for argument list
     if (command->args == NULL) { // On failure to allocate memory free allocated memory, print error message and return gracefully
@@ -92,11 +142,13 @@ bool init_struct(Command *command, char *command_name, size_t arg_count, char **
 }
 
 // Frees all dynamically allocated memory associated with a Command struct
-// This includes the command name, argument list, and output file if present
+// This includes the command name, argument list, and output file if present, and the later stages of a pipeline
 void free_struct(Command *command) {
     if (command == NULL)
         return; // Return on NULL value
 
+    free_struct(command->next); // Free the rest of the pipeline
+
     if (command->command != NULL) {
         free(command->command); // Free command value
     }
@@ -153,6 +205,9 @@ char *trim(char *str) {
 // Function to update Paths
 // Extracts new path values from a Command struct and updates the paths list accordingly
 bool update_path(Command *command, char ***paths, size_t *path_count) {
+    // Remembered locations may not be valid for the new path(s)
+    hash_clear();
+
     // Cleanup old path(s)
     size_t count = *path_count;
     for (int i = 0; i < count; i++) {
@@ -221,14 +276,198 @@ char *resolve_path(char *command_name, char **paths, size_t path_count) {
         free(full_path);
     }
 
-    return NULL; // Command not found in paths
+    // Command not found in paths
+    custom_write(STDERR_FILENO, COMMAND_ERROR_MSG, strlen(COMMAND_ERROR_MSG));
+    return NULL;
+}
+
+// FNV-1a hash of a command name
+uint64_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *) name; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Finds the slot of a command name, or the empty slot where it would go
+HashEntry *hash_slot(HashEntry *table, size_t capacity, const char *name) {
+    size_t i = hash_name(name) & (capacity - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &table[i];
+}
+
+// Adds a resolved command to the hash table, which takes ownership of both strings
+// The table is doubled when it gets three quarters full
+// Returns false on memory allocation failure, the strings are then left to the caller
+bool hash_insert(char *name, char *full_path) {
+    if ((hash_count + 1) * 4 > hash_capacity * 3) {
+        size_t new_capacity = hash_capacity ? hash_capacity * 2 : HASH_INITIAL_SIZE;
+        HashEntry *new_table = calloc(new_capacity, sizeof(HashEntry));
+        if (new_table == NULL) {
+            custom_write(STDERR_FILENO, MEMORY_ERROR_MSG, strlen(MEMORY_ERROR_MSG));
+            return false;
+        }
+        // Move the old entries to their slots in the new table
+        for (size_t i = 0; i < hash_capacity; i++) {
+            if (hash_table[i].name != NULL) {
+                *hash_slot(new_table, new_capacity, hash_table[i].name) = hash_table[i];
+            }
+        }
+        free(hash_table);
+        hash_table = new_table;
+        hash_capacity = new_capacity;
+    }
+
+    HashEntry *entry = hash_slot(hash_table, hash_capacity, name);
+    entry->name = name;
+    entry->full_path = full_path;
+    entry->hits = 0;
+    hash_count++;
+    return true;
+}
+
+// Forgets all remembered command locations
+void hash_clear(void) {
+    for (size_t i = 0; i < hash_capacity; i++) {
+        free(hash_table[i].name);
+        free(hash_table[i].full_path);
+    }
+    free(hash_table);
+    hash_table = NULL;
+    hash_capacity = 0;
+    hash_count = 0;
+}
+
+// Prints the remembered commands with their hit counts, in the same layout as the bash hash builtin
+void hash_print(void) {
+    if (hash_count == 0) {
+        custom_write(STDOUT_FILENO, HASH_EMPTY_MSG, strlen(HASH_EMPTY_MSG));
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < hash_capacity; i++) {
+        if (hash_table[i].name != NULL) {
+            printf("%4zu\t%s\n", hash_table[i].hits, hash_table[i].full_path);
+        }
+    }
+    fflush(stdout);
+}
+
+// Function to find the executable for a command, run in the shell before forking
+// Looks the command up in the hash table first and only searches the path directories on a miss
+// Returns the full path owned by the hash table, or NULL if the command was not found
+char *find_command(char *command_name, char **paths, size_t path_count) {
+    if (hash_count > 0) {
+        HashEntry *entry = hash_slot(hash_table, hash_capacity, command_name);
+        if (entry->name != NULL) {
+            entry->hits++;
+            return entry->full_path;
+        }
+    }
+
+    char *full_path = resolve_path(command_name, paths, path_count);
+    if (full_path == NULL) {
+        return NULL;
+    }
+    char *name = strdup(command_name);
+    if (name == NULL || !hash_insert(name, full_path)) {
+        if (name == NULL) {
+            custom_write(STDERR_FILENO, MEMORY_ERROR_MSG, strlen(MEMORY_ERROR_MSG));
+        }
+        free(name);
+        free(full_path);
+        return NULL;
+    }
+    HashEntry *entry = hash_slot(hash_table, hash_capacity, command_name);
+    entry->hits++;
+    return entry->full_path;
+}
+
+// Prepares an empty job table for a line with job_count & commands
+// Returns false on memory allocation failure
+bool job_init(JobTable *table, size_t job_count) {
+    memset(table, 0, sizeof(JobTable));
+    table->remaining = calloc(job_count, sizeof(size_t));
+    if (table->remaining == NULL) {
+        custom_write(STDERR_FILENO, MEMORY_ERROR_MSG, strlen(MEMORY_ERROR_MSG));
+        return false;
+    }
+    return true;
+}
+
+void job_free(JobTable *table) {
+    free(table->pids);
+    free(table->jobs);
+    free(table->remaining);
+}
+
+// Records a started child process of a job, the table grows as needed
+// If the table cannot grow the child is waited for right away, so it is never left behind as a zombie
+void job_add(JobTable *table, pid_t pid, size_t job) {
+    if (table->count == table->capacity) {
+        size_t new_capacity = table->capacity ? table->capacity * 2 : JOB_INITIAL_SIZE;
+        pid_t *new_pids = realloc(table->pids, sizeof(pid_t) * new_capacity);
+        if (new_pids != NULL) {
+            table->pids = new_pids;
+        }
+        size_t *new_jobs = (new_pids != NULL) ? realloc(table->jobs, sizeof(size_t) * new_capacity) : NULL;
+        if (new_jobs == NULL) {
+            custom_write(STDERR_FILENO, MEMORY_ERROR_MSG, strlen(MEMORY_ERROR_MSG));
+            waitpid(pid, NULL, 0);
+            return;
+        }
+        table->jobs = new_jobs;
+        table->capacity = new_capacity;
+    }
+
+    table->pids[table->count] = pid;
+    table->jobs[table->count] = job;
+    table->count++;
+    if (table->remaining[job]++ == 0) {
+        table->running++;
+    }
+}
+
+// Waits for whichever child process finishes first and removes it from the table
+// Children are reaped in the order they complete, so a slow job does not hold up the others
+void job_reap(JobTable *table) {
+    siginfo_t info;
+
+    while (waitid(P_ALL, 0, &info, WEXITED) == -1) {
+        if (errno == EINTR) {
+            continue;
+        }
+        // No children left, nothing in the table is still running
+        custom_write(STDERR_FILENO, PID_ERROR_MSG, strlen(PID_ERROR_MSG));
+        table->count = 0;
+        table->running = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < table->count; i++) {
+        if (table->pids[i] == info.si_pid) {
+            size_t job = table->jobs[i];
+            // Move the last child into the freed slot
+            table->count--;
+            table->pids[i] = table->pids[table->count];
+            table->jobs[i] = table->jobs[table->count];
+            if (--table->remaining[job] == 0) {
+                table->running--;
+            }
+            return;
+        }
+    }
 }
 
 // Function to parse an input line and execute it
-void parse_line(char *curr_line, char **paths, size_t *path_count) {
+// paths is passed by reference so the path built-in can replace the caller's list
+void parse_line(char *curr_line, char ***paths, size_t *path_count) {
 
-    size_t pid_count = 0;       // Track child processes amount
-    pid_t pids[MAX_PID_COUNT];  // Array to hold child process IDs
+    JobTable table;             // Child processes of the line
 
     if (strstr(curr_line, "&") != NULL) { // Parallel execution mode when & is present
 
@@ -248,7 +487,7 @@ void parse_line(char *curr_line, char **paths, size_t *path_count) {
         while (curr_command != NULL) {
 
             // Parse the current command and add it to the array
-            Command *command = parse_command(curr_command);
+            Command *command = parse_pipeline(curr_command);
             if(command == NULL) { // On fail cleanup already parsed commands
                 custom_write(STDERR_FILENO, MEMORY_ERROR_MSG, strlen(MEMORY_ERROR_MSG));
                 for (int i = 0; i < command_array_size; i++) {
@@ -277,42 +516,53 @@ void parse_line(char *curr_line, char **paths, size_t *path_count) {
             curr_command = strtok_r(NULL, "&", &saveptr); // Move to next parallel command
         }
 
+        if (!job_init(&table, command_array_size)) {
+            for (int i = 0; i < command_array_size; i++) {
+                free_struct(command_array[i]);  // Free each Command
+            }
+            free(command_array);  // Free the array of commands
+            return;
+        }
+
         // Execute all parsed commands in parallel
+        // With wish -j N the commands wait in the array, in order, until fewer than N jobs are running
         for (int i = 0; i < command_array_size; i++) {
 
+            while (max_jobs > 0 && table.running >= max_jobs) {
+                job_reap(&table);
+            }
+
+            // A pipeline starts all of its stages at once
+            if (command_array[i]->next != NULL) {
+                launch_pipeline(command_array[i], paths, path_count, curr_line, &table, i);
+                continue;
+            }
+
             // Check if command is built-in and handle internally
-            if (built_in_commands(command_array[i], &paths, path_count, curr_line)) {
+            if (built_in_commands(command_array[i], paths, path_count, curr_line)) {
                 free_struct(command_array[i]);
+                command_array[i] = NULL;
                 continue;
             }
 
-            // Fork a child process to run the command
-            pid_t pid = fork();
-            if (pid != 0) {
-                // Parent process
-                pids[pid_count] = pid;
-                pid_count++;
-                
-            } else if (pid == 0) {
-                // Child process
-                size_t count = *path_count;                
-                execute_command(command_array[i], paths, count);
-                exit(0);
-            } else {
-                // Fork fail
-                custom_write(STDERR_FILENO, FORK_ERROR_MSG, strlen(FORK_ERROR_MSG));
+            // Resolve the executable in the shell itself so the hash table is filled
+            char *full_path = find_command(command_array[i]->command, *paths, *path_count);
+            if (full_path == NULL) {
+                continue;
             }
 
+            // Start a child process to run the command
+            pid_t pid = launch_command(command_array[i], full_path, -1, -1);
+            if (pid != -1) {
+                job_add(&table, pid, i);
+            }
         }
 
-        // Wait for all child processes to complete
-        for (int i = 0; i < pid_count; i++) {
-            pid_t wpid = waitpid(pids[i], NULL, 0);
-            if (wpid == -1) {
-                //waitpid fail
-                custom_write(STDERR_FILENO, PID_ERROR_MSG, strlen(PID_ERROR_MSG)); 
-            }
+        // Wait for all child processes to complete, in the order they finish
+        while (table.count > 0) {
+            job_reap(&table);
         }
+        job_free(&table);
 
         // Cleanup allocated memory
         for (int i = 0; i < command_array_size; i++) {
@@ -323,23 +573,41 @@ void parse_line(char *curr_line, char **paths, size_t *path_count) {
     } else { // Single command execution
 
         // Parse the input into a Command struct
-        Command *command = parse_command(curr_line);
+        Command *command = parse_pipeline(curr_line);
         if(command == NULL) {
             return;
         }
 
+        // A pipeline starts all of its stages at once and is waited for as a whole
+        if (command->next != NULL) {
+            if (job_init(&table, 1)) {
+                launch_pipeline(command, paths, path_count, curr_line, &table, 0);
+                while (table.count > 0) {
+                    job_reap(&table);
+                }
+                job_free(&table);
+            }
+            free_struct(command);
+            return;
+        }
+
         // Handle built-in commands internally
-        if(built_in_commands(command, &paths, path_count, curr_line) == true) {
+        if(built_in_commands(command, paths, path_count, curr_line) == true) {
             free_struct(command);  // Free Command
             return;
         }
 
-        // Fork a new process
-        pid_t pid = fork();
-            if (pid != 0) {
-                // Parent process
-                pids[pid_count++] = pid;
+        // Resolve the executable in the shell itself so the hash table is filled
+        char *full_path = find_command(command->command, *paths, *path_count);
+        if (full_path == NULL) {
+            free_struct(command);
+            return;
+        }
 
+        // Start a new process
+        pid_t pid = launch_command(command, full_path, -1, -1);
+            if (pid != -1) {
+                // Parent process
                 int status;
                 pid_t wpid = waitpid(pid, &status, 0);
 
@@ -358,15 +626,6 @@ void parse_line(char *curr_line, char **paths, size_t *path_count) {
                         // printf("stopped signal\n");
                     }
                 }
-                
-            } else if (pid == 0) {
-                // Child process
-                size_t count = *path_count;  
-                execute_command(command, paths, count);
-                exit(0);
-            } else {
-                // Fork fail
-                custom_write(STDERR_FILENO, FORK_ERROR_MSG, strlen(FORK_ERROR_MSG));
             }
 
         free_struct(command);  // Free Command
@@ -558,49 +817,209 @@ Command *parse_command(char *command) {
     return cmd;
 }
 
-// Function to execute a command after parsing
-// This function handles the execution of non-built-in shell commands
-void execute_command(Command *command, char **paths, size_t path_count) {
+// Parses a command line that may be a pipeline (e.g., "cat log | grep x | sort > out.txt")
+// Each stage between | is parsed with parse_command and linked to the next one
+// Returns the first stage, or NULL on a parse error or an empty line
+Command *parse_pipeline(char *line) {
+    if (strchr(line, '|') == NULL) {
+        return parse_command(line);
+    }
+
+    Command *first = NULL;
+    Command *last = NULL;
+    char *stage = line;
+
+    while (stage != NULL) {
+        // Cut the line at the next |
+        char *bar = strchr(stage, '|');
+        if (bar != NULL) {
+            *bar = '\0';
+        }
+
+        // Every stage needs a command, "ls |" and "ls || wc" are invalid
+        if (stage[strspn(stage, " \t")] == '\0') {
+            custom_write(STDERR_FILENO, ERROR_MSG, strlen(ERROR_MSG));
+            free_struct(first);
+            return NULL;
+        }
+
+        Command *command = parse_command(stage);
+        if (command == NULL) {
+            free_struct(first);
+            return NULL;
+        }
+        if (first == NULL) {
+            first = command;
+        } else {
+            last->next = command;
+        }
+        last = command;
+
+        stage = (bar != NULL) ? bar + 1 : NULL;
+    }
+
+    // Output of the earlier stages goes to the next stage, only the last one may redirect
+    for (Command *command = first; command->next != NULL; command = command->next) {
+        if (command->redirect == 1) {
+            custom_write(STDERR_FILENO, REDIRECT_ERROR_MSG, strlen(REDIRECT_ERROR_MSG));
+            free_struct(first);
+            return NULL;
+        }
+    }
+    return first;
+}
+
+// Function to start an external command without copying the shell
+// posix_spawn creates the child without duplicating the shell's page tables, so the cost does not grow with the shell
+// The output file of a > redirection is opened here and put on stdout and stderr of the child with file actions
+// input and output are pipe ends for stdin and stdout of a pipeline stage, -1 to keep the shell's own
+// Returns the child pid, or -1 if the command could not be started
+pid_t launch_command(Command *command, char *full_path, int input, int output) {
     // Create arguments list for execution
-    char *args[command->arg_count];
+    char *args[command->arg_count + 1];
     for (int i = 0; i < command->arg_count; i++) {
         args[i] = command->args[i];
     }
     args[command->arg_count] = NULL; // Null-terminate the argument list
 
-    // Resolve path from default /bin or user provided paths
-    char *full_path = resolve_path(command->command, paths, path_count);
-    if (full_path == NULL) {
-        return;
-    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t *file_actions = NULL;
+    int fd = -1;
 
     // Handle file redirection if enabled
     if (command->redirect == 1) {
-        int fd = open(command->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        // Close-on-exec so commands started at the same time do not inherit it, dup2 clears the flag on the copies
+        fd = open(command->output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
         if (fd == -1) {
             custom_write(STDERR_FILENO, FILE_ERROR_MSG, strlen(FILE_ERROR_MSG));
-            free(full_path);
-            return;
+            return -1;
         }
+    }
 
-        // Redirect stdout and stderr to file using file descriptor
-        dup2(fd, STDOUT_FILENO);
-        dup2(fd, STDERR_FILENO);
+    if (fd != -1 || input != -1 || output != -1) {
+        if (posix_spawn_file_actions_init(&actions) != 0) {
+            custom_write(STDERR_FILENO, MEMORY_ERROR_MSG, strlen(MEMORY_ERROR_MSG));
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+        file_actions = &actions;
+
+        // Connect the pipeline pipes, then redirect stdout and stderr to file using file descriptor
+        if ((input != -1 && posix_spawn_file_actions_adddup2(file_actions, input, STDIN_FILENO) != 0) ||
+            (output != -1 && posix_spawn_file_actions_adddup2(file_actions, output, STDOUT_FILENO) != 0) ||
+            (fd != -1 && posix_spawn_file_actions_adddup2(file_actions, fd, STDOUT_FILENO) != 0) ||
+            (fd != -1 && posix_spawn_file_actions_adddup2(file_actions, fd, STDERR_FILENO) != 0)) {
+            custom_write(STDERR_FILENO, MEMORY_ERROR_MSG, strlen(MEMORY_ERROR_MSG));
+            posix_spawn_file_actions_destroy(file_actions);
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+    }
+
+    pid_t pid;
+    int error = posix_spawn(&pid, full_path, file_actions, NULL, args, environ);
+
+    if (file_actions != NULL) {
+        posix_spawn_file_actions_destroy(file_actions);
+    }
+    if (fd != -1) {
         close(fd);
     }
 
-    // Execute command
-    if (execv(full_path, args) == -1) {
-        // execv fail
-        fprintf(stderr, "%s: %s\n", command->command, strerror(errno));
-        exit(1);
+    if (error != 0) {
+        // Named after the command, like the error of a failed exec in other shells
+        fprintf(stderr, "%s: %s\n", command->command, strerror(error));
+        return -1;
+    }
+    return pid;
+}
+
+// Function to run a built-in command as a pipeline stage
+// The built-in runs in a forked copy of the shell, like in other shells, so cd or path there do not change the shell
+// Returns the child pid, or -1 if the fork failed
+pid_t fork_built_in(Command *command, char ***paths, size_t *path_count, char *curr_line, int input, int output) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process
+        if (input != -1) {
+            dup2(input, STDIN_FILENO);
+        }
+        if (output != -1) {
+            dup2(output, STDOUT_FILENO);
+        }
+        // exit only ends this stage, which happens anyway
+        if (strcmp(command->command, "exit") != 0) {
+            built_in_commands(command, paths, path_count, curr_line);
+        }
+        // _exit, because exit would sync the batch file's stdio buffer and move the offset the shell reads from
+        fflush(stdout);
+        _exit(0);
+    } else if (pid == -1) {
+        // Fork fail
+        custom_write(STDERR_FILENO, FORK_ERROR_MSG, strlen(FORK_ERROR_MSG));
+    }
+    return pid;
+}
+
+// Function to start every stage of a pipeline at once
+// Each stage writes into a pipe that the next stage reads, the pipes are enlarged so stages block less often
+// All pipe ends are close-on-exec, every child only keeps the two it gets as stdin and stdout
+// The started stages are added to the job table as one job, a stage that cannot be started leaves its neighbours
+// reading end of file or writing into a closed pipe, as in other shells
+void launch_pipeline(Command *first, char ***paths, size_t *path_count, char *curr_line, JobTable *table, size_t job) {
+    int input = -1;     // Read end of the pipe from the previous stage
+
+    for (Command *stage = first; stage != NULL; stage = stage->next) {
+        int pipe_fds[2] = { -1, -1 };
+
+        if (stage->next != NULL) {
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                custom_write(STDERR_FILENO, ERROR_MSG, strlen(ERROR_MSG));
+                break;
+            }
+            // Best effort, a smaller pipe only means more context switches
+            fcntl(pipe_fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+        }
+
+        pid_t pid = -1;
+        if (is_built_in(stage)) {
+            pid = fork_built_in(stage, paths, path_count, curr_line, input, pipe_fds[1]);
+        } else {
+            char *full_path = find_command(stage->command, *paths, *path_count);
+            if (full_path != NULL) {
+                pid = launch_command(stage, full_path, input, pipe_fds[1]);
+            }
+        }
+        if (pid != -1) {
+            job_add(table, pid, job);
+        }
+
+        // The children have their copies, the shell keeps only the read end for the next stage
+        if (input != -1) {
+            close(input);
+        }
+        if (pipe_fds[1] != -1) {
+            close(pipe_fds[1]);
+        }
+        input = pipe_fds[0];
     }
 
-    free(full_path);
-    return;
+    if (input != -1) {
+        close(input);
+    }
+}
+
+// Checks whether a command is one of the built-ins handled by built_in_commands
+bool is_built_in(Command *command) {
+    return strcmp(command->command, "exit") == 0 || strcmp(command->command, "cd") == 0 ||
+           strcmp(command->command, "path") == 0 || strcmp(command->command, "hash") == 0;
 }
 
-// Function to handle built-in shell commands (exit, cd, path)
+// Function to handle built-in shell commands (exit, cd, path, hash)
 // Returns true if the command was a built-in and has been handled, false if the command is not a built-in
 bool built_in_commands(Command *command, char ***paths, size_t *path_count, char *curr_line) {
     size_t count = *path_count;
@@ -613,6 +1032,7 @@ bool built_in_commands(Command *command, char ***paths, size_t *path_count, char
             free((*paths)[i]);
         }
         free(*paths);
+        hash_clear();
         free(curr_line);
         exit(0);
     } else if (strcmp(command->command, "exit") == 0 && command->arg_count > 1) {
@@ -628,11 +1048,31 @@ bool built_in_commands(Command *command, char ***paths, size_t *path_count, char
         } else {
             if (chdir(command->args[1]) == -1) {
                 custom_write(STDERR_FILENO, ERROR_MSG, strlen(ERROR_MSG));
+            } else {
+                // Commands found through a relative path directory may now be somewhere else
+                for (int i = 0; i < count; i++) {
+                    if ((*paths)[i][0] != '/') {
+                        hash_clear();
+                        break;
+                    }
+                }
             }
         }
         return true;
     }
 
+    // Check if user wants to see or forget the remembered command locations
+    if (strcmp(command->command, "hash") == 0) {
+        if (command->arg_count == 1) {
+            hash_print();
+        } else if (command->arg_count == 2 && strcmp(command->args[1], "-r") == 0) {
+            hash_clear();
+        } else {
+            custom_write(STDERR_FILENO, ARGS_ERROR_MSG, strlen(ARGS_ERROR_MSG));
+        }
+        return true;
+    }
+
     // Check if user wants to update paths
     if (strcmp(command->command, "path") == 0) {
         if (update_path(command, paths, path_count)) {
@@ -642,6 +1082,20 @@ bool built_in_commands(Command *command, char ***paths, size_t *path_count, char
     return false;
 }
 
+// Matches an option letter alone, with the number in the next argument, or with the digits attached (-j4)
+// A batch file whose name only starts with the letter, like -jobs.sh, is not the option
+bool is_number_option(const char *arg, char letter) {
+    if (arg[0] != '-' || arg[1] != letter) {
+        return false;
+    }
+    for (const char *c = arg + 2; *c != '\0'; c++) {
+        if (*c < '0' || *c > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char *argv[]) {
 
     // Allocate memory and set the default /bin path
@@ -656,6 +1110,23 @@ int main(int argc, char *argv[]) {
 
     char *input = NULL;
     size_t len = 0;
+
+    // Optional limit on the & commands of a line running at the same time: wish -j N [batch file]
+    if (argc >= 2 && is_number_option(argv[1], 'j')) {
+        int used = (argv[1][2] != '\0') ? 1 : 2;
+        const char *value = (used == 1) ? argv[1] + 2 : (argc >= 3 ? argv[2] : "");
+        char *end = NULL;
+        long n = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || n < 1) {
+            custom_write(STDERR_FILENO, ARGS_ERROR_MSG, strlen(ARGS_ERROR_MSG));
+            free(paths[0]);
+            free(paths);
+            exit(1);
+        }
+        max_jobs = n;
+        argc -= used;
+        argv += used;
+    }
     
     // Determine execution mode
     // mode 0 = interactive, mode 1 = batch, mode -1 = invalid
@@ -677,7 +1148,7 @@ int main(int argc, char *argv[]) {
                 input[strcspn(input, "\n")] = '\0';
     
                 // Process the input line
-                parse_line(input, paths, &path_count);
+                parse_line(input, &paths, &path_count);
             }
             break;
 
@@ -707,7 +1178,7 @@ int main(int argc, char *argv[]) {
             size_t len = 0;
             while (getline(&line, &len, file) != -1) {
                 line[strcspn(line, "\n")] = 0;  // Remove newline character
-                parse_line(line, paths, &path_count);
+                parse_line(line, &paths, &path_count);
             }
         
             free(line);
@@ -732,6 +1203,7 @@ int main(int argc, char *argv[]) {
         free(paths[i]);
     }
     free(paths);
+    hash_clear();
 
     return 0;
 }
\ No newline at end of file